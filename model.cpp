@@ -8,43 +8,72 @@
 #include <utility>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <iterator>
+#include <charconv>
+#include <cctype>
+#include <cerrno>
+#if defined(__unix__) || defined(__APPLE__)
+#define KINETICS_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <csignal>
+#else
+#define KINETICS_MMAP 0
+#endif
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <unordered_map>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <random>
+
+// Scalar type of the aggregate chain, which holds nearly all of the state and
+// the work: -DKINETICS_REAL=float for quick screening sweeps, long double for
+// reference runs. Monomers, rate constants, fits and files stay double.
+#ifndef KINETICS_REAL
+#define KINETICS_REAL double
+#endif
+typedef KINETICS_REAL real;
 
 static const int RATE_CONSTANTS = 3;
+static const int PARAM_COUNT = 2 + 2 * RATE_CONSTANTS; // n, r, forward, backward
 static const int ARRAY_LIMIT = 200;
 static const unsigned int PROC_COUNT = std::thread::hardware_concurrency();
 static const int DEFAULT_POINTS = 1000;
+static const double DEFAULT_RTOL = 1e-6;
+static const double DEFAULT_ATOL = 1e-16;
+static const long STEP_LIMIT = 10000000; // adaptive steps a run may take before it counts as diverged
+static const int OUTPUT_BUFFER = 1 << 20;
+static const int FIT_ITERATIONS = 100;
+static const double METRICS_INTERVAL = 1; // seconds between lines of the metrics file
+static const double STEADY_WINDOW = 0.05; // part of a run the rates have to stay below --steady= for
 
 class Params {
     public:
         double n;
         double r;
-        std::vector<double> forward;
-        std::vector<double> backward;
-		Params(double n, double r, std::vector<double> forward, std::vector<double> backward)
+        std::array<double, RATE_CONSTANTS> forward; // fixed size, so simplex arithmetic never allocates
+        std::array<double, RATE_CONSTANTS> backward;
+		Params(double n, double r, std::array<double, RATE_CONSTANTS> forward, std::array<double, RATE_CONSTANTS> backward)
 			: n(n), r(r), forward(forward), backward(backward) {};
         Params()
-            : n(0), r(0), forward(RATE_CONSTANTS, 0), backward(RATE_CONSTANTS, 0) {};
-        Params(std::stringstream &line) 
-            : forward(RATE_CONSTANTS), backward(RATE_CONSTANTS)
-        {
-            std::string temp;
-            std::getline(line, temp, ',');
-            n = std::stod(temp);
-            std::getline(line, temp, ',');
-            r = std::stod(temp);
-            std::getline(line, temp, ',');
-            forward[0] = std::stod(temp);
-            std::getline(line, temp, ',');
-            forward[1] = std::stod(temp);
-            std::getline(line, temp, ',');
-            forward[2] = std::stod(temp);
-            std::getline(line, temp, ',');
-            backward[0] = std::stod(temp);
-            std::getline(line, temp, ',');
-            backward[1] = std::stod(temp);
-            std::getline(line, temp, ',');
-            backward[2] = std::stod(temp);
-        }
+            : n(0), r(0), forward(), backward() {};
         bool is_positive() {
             if (n < 0) return false;
             if (r < 0) return false;
@@ -54,6 +83,11 @@ class Params {
             }
             return true;
         }
+        double& component(int k) {
+            if (k == 0) return n;
+            if (k == 1) return r;
+            return k < 2 + RATE_CONSTANTS ? forward[k - 2] : backward[k - 2 - RATE_CONSTANTS];
+        }
         Params operator+(const Params& other) {
             Params ans;
             ans.n = n + other.n;
@@ -85,39 +119,136 @@ class Params {
             return ans;
         }
         void print() {
-            std::cout << "n: " << n << std::endl;
-            std::cout << "r: " << r << std::endl;
-            std::cout << "forward: " << forward[0] << ',' << forward[1] << ',' << forward[2] << std::endl;
-            std::cout << "backward: " << backward[0] << ',' << backward[1] << ',' << backward[2] << std::endl;
+            std::cout << "n: " << n << '\n';
+            std::cout << "r: " << r << '\n';
+            std::cout << "forward: " << forward[0] << ',' << forward[1] << ',' << forward[2] << '\n';
+            std::cout << "backward: " << backward[0] << ',' << backward[1] << ',' << backward[2] << '\n';
         }
 };
 
+static const int INTEGER_ORDERS = 8; // nucleation orders r = 1..8 get kernels of their own
+
+// x^R as a chain of multiplications
+template<int R> inline double integer_power(double x) {
+    return integer_power<R / 2>(x * x) * (R % 2 ? x : 1);
+}
+template<> inline double integer_power<0>(double) {
+    return 1;
+}
+
+// am^r in a kernel built for order R, R = 0 being the generic std::pow
+template<int R> inline double order_power(double am, double /* r */) {
+    return integer_power<R>(am);
+}
+template<> inline double order_power<0>(double am, double r) {
+    return std::pow(am, r);
+}
+
+// Kernel tables are indexed by r for the integer orders 1..INTEGER_ORDERS, by 0 otherwise
+inline int order_index(double r) {
+    return r >= 1 && r <= INTEGER_ORDERS && r == (int) r ? (int) r : 0;
+}
+
+typedef double (*PowerKernel)(double am, double r);
+static const PowerKernel POWER_KERNELS[] = {order_power<0>, order_power<1>, order_power<2>, order_power<3>, order_power<4>, order_power<5>, order_power<6>, order_power<7>, order_power<8>};
+
+double nucleation_power(double am, double r) {
+    return POWER_KERNELS[order_index(r)](am, r);
+}
+
+// Optional coarse graining of the aggregate chain past the exact sizes.
+// Chain entry i stands for aggregates of size n + size(i): the first entries
+// are single sizes, later ones bins whose width grows geometrically. A
+// monomer added to or lost from an entry is split between it and its
+// neighbour so that both number and mass are kept (fixed pivot), which
+// weights the flux between entries i and i + 1 by 1 / (size(i + 1) - size(i)).
+// Without a layout every size is its own entry and every weight is 1.
+class Bins {
+    public:
+        std::vector<double> sizes;
+        std::vector<double> weights; // the last one is for flux leaving the chain
+        bool active() {
+            return !sizes.empty();
+        };
+        int count() {
+            return sizes.size();
+        };
+        // Chain length of the adaptive methods, the one they start from without bins
+        int limit() {
+            return active() ? count() : ARRAY_LIMIT;
+        };
+        double size(int i) {
+            return active() ? sizes[i] : i;
+        };
+        double weight(int i) {
+            return active() ? weights[i] : 1;
+        };
+        // exact single sizes, then bins each about ratio times as wide as
+        // the sizes before them, until size largest is covered
+        void layout(int exact, double ratio, double largest) {
+            if (exact < 1 || !(ratio > 1) || largest < exact) throw std::runtime_error("Bins need at least one exact size, a ratio above 1 and a largest size past the exact ones");
+            sizes.clear();
+            weights.clear();
+            for (int i = 0; i < exact; i++) sizes.push_back(i);
+            double low = exact, high = exact;
+            while (low <= largest) {
+                high = std::max(low + 1, std::round(low * ratio));
+                sizes.push_back((low + high - 1) / 2);
+                low = high;
+            }
+            for (int i = 0; i + 1 < sizes.size(); i++) weights.push_back(1 / (sizes[i + 1] - sizes[i]));
+            weights.push_back(1 / (high - sizes.back()));
+        };
+        // Moves single-size concentrations onto the entries, keeping number and mass
+        void lump(std::vector<real>& agg) {
+            std::vector<real> lumped(count(), 0);
+            for (int i = 0; i < agg.size(); i++) {
+                int j = std::upper_bound(sizes.begin(), sizes.end(), (double) i) - sizes.begin() - 1;
+                if (j == count() - 1) {
+                    lumped[j] += agg[i];
+                    continue;
+                }
+                double share = (i - sizes[j]) * weights[j];
+                lumped[j] += agg[i] * (1 - share);
+                lumped[j + 1] += agg[i] * share;
+            }
+            while (lumped.size() > 1 && lumped.back() == 0) lumped.pop_back();
+            agg.swap(lumped);
+        };
+};
+
+static Bins bins;
+
 class Conditions {
     public:
         double im;
         double am;
-        std::vector<double> agg;
+        std::vector<real> agg;
+        double count; // zeroth and first moments of agg, carried through the steps once measured
+        double mass;
 		Conditions()
-			: im(0), am(0), agg() {};
+			: im(0), am(0), agg(), count(0), mass(0) {};
         Conditions(int size)
-            : im(0), am(0), agg()
+            : im(0), am(0), agg(), count(0), mass(0)
         {
             agg.resize(size);
         };
-        Conditions(std::stringstream &line) {
-            std::string temp;
-            std::getline(line, temp, ',');
-            im = std::stod(temp);
-            std::getline(line, temp, ',');
-            am = std::stod(temp);
-            while (std::getline(line, temp, ',')) {
-                agg.push_back(std::stod(temp));
-            }
-        }
-        Conditions(double im, double am, std::vector<double>& agg)
-            : im(im), am(am), agg(agg) {};
+        Conditions(double im, double am, std::vector<real>& agg)
+            : im(im), am(am), agg(agg), count(0), mass(0) {};
         Conditions(const Conditions &orig)
-            : im(orig.im), am(orig.am), agg(orig.agg) {};
+            : im(orig.im), am(orig.am), agg(orig.agg), count(orig.count), mass(orig.mass) {};
+        Conditions& operator=(const Conditions&) = default;
+        void swap(Conditions& other) {
+            std::swap(im, other.im);
+            std::swap(am, other.am);
+            agg.swap(other.agg);
+            std::swap(count, other.count);
+            std::swap(mass, other.mass);
+        };
+        // A non-finite aggregate reaches am through elongation on the next step
+        bool finite() {
+            return std::isfinite(im) && std::isfinite(am) && std::isfinite(count) && std::isfinite(mass);
+        };
         Conditions next(Params& params, double step_size) {
             int agg_size = agg.size();
             Conditions next_con(agg_size + 1);
@@ -128,7 +259,8 @@ class Conditions {
             diff = 0; // calculating am
             diff += im * params.forward[0];
             diff -= am * params.backward[0];
-            diff -= params.n * std::pow(am, params.r) * params.forward[1];
+            double power = nucleation_power(am, params.r);
+            diff -= params.n * power * params.forward[1];
             diff += params.n * agg[0] * params.backward[1];
             for (int i = 0; i < agg_size - 1; i++) {
                 diff -= am * agg[i] * params.forward[2];
@@ -138,7 +270,7 @@ class Conditions {
             next_con.am = am + step_size * diff;
 
             diff = 0; // calculating first aggregate
-            diff += std::pow(am, params.r) * params.forward[1];
+            diff += power * params.forward[1];
             diff -= agg[0] * params.backward[1];
             diff -= am * agg[0] * params.forward[2];
             diff += agg[1] * params.backward[2];
@@ -157,315 +289,2463 @@ class Conditions {
             diff += am * agg[agg_size - 2] * params.forward[2];
             diff -= agg[agg_size - 1] * params.backward[2];
             diff -= am * agg[agg_size - 1] * params.forward[2];
-            next_con.agg[agg_size - 1] = agg[agg_size - 2] + step_size * diff;
+            next_con.agg[agg_size - 1] = agg[agg_size - 1] + step_size * diff;
 
             diff = 0; // calculating next aggregate
             diff += am * agg[agg_size - 1] * params.forward[2];
             next_con.agg[agg_size] = 0 + step_size * diff;
 
-            while ( (agg.size() > 2 && agg[agg.size() - 1] == 0) || agg.size() > ARRAY_LIMIT ) agg.pop_back();
+            // the new state is trimmed, this one is left as it was
+            std::vector<real>& next_agg = next_con.agg;
+            while ( (next_agg.size() > 2 && next_agg[next_agg.size() - 1] == 0) || next_agg.size() > ARRAY_LIMIT ) next_agg.pop_back();
 
             return next_con;
         };
         double agg_mass(Params& params) {
             double mass = 0;
             for (int i = 0; i < agg.size(); i++) {
-                mass += agg[i] * (params.n + i);
+                mass += agg[i] * (params.n + bins.size(i));
             }
             return mass;
         };
+        // Sets the moments from the full sums, before a run with these params
+        void measure(Params& params) {
+            count = 0;
+            for (int i = 0; i < agg.size(); i++) count += agg[i];
+            mass = agg_mass(params);
+        };
 };
 
-void become_next(Conditions& A, Conditions& B, Params& params, double step_size) {
+// Aggregate chain kernels. flux[i] is the net elongation flux from size i to
+// size i + 1, ke * am * agg[i] - kem * agg[i + 1], with nothing past the last
+// size; chain_flux returns the monomers taken up by all of it. chain_apply
+// writes out[i] = base[i] + h * (flux[i - 1] - flux[i]) with flux_in standing
+// in for flux[-1], and a null base counting as zero. The vector versions sum
+// the flux in a different order and use fused multiply-adds, so they agree
+// with the scalar loop to about 1e-14 relative rather than bit for bit. The
+// vector versions are for double chains only, other real types run the scalar ones.
+typedef double (*FluxKernel)(const real* agg, real* flux, int size, double ke_am, double kem);
+typedef void (*ApplyKernel)(const real* base, const real* flux, real* out, int size, double h, double flux_in);
+
+template<typename T> static double flux_scalar(const T* agg, T* flux, int size, double ke_am, double kem) {
+    double total = 0;
+    for (int i = 0; i < size - 1; i++) {
+        flux[i] = ke_am * agg[i] - kem * agg[i + 1];
+        total += flux[i];
+    }
+    flux[size - 1] = ke_am * agg[size - 1];
+    return total + flux[size - 1];
+}
+
+// flux_scalar with flux[i] scaled by weight[i]; the returned monomer uptake is not
+template<typename T> static double flux_weighted(const T* agg, T* flux, int size, double ke_am, double kem, const double* weight) {
+    double total = 0;
+    for (int i = 0; i < size - 1; i++) {
+        double J = ke_am * agg[i] - kem * agg[i + 1];
+        flux[i] = J * weight[i];
+        total += J;
+    }
+    flux[size - 1] = ke_am * agg[size - 1] * weight[size - 1];
+    return total + ke_am * agg[size - 1];
+}
+
+template<typename T> static void apply_scalar(const T* base, const T* flux, T* out, int size, double h, double flux_in) {
+    out[0] = (base ? base[0] : 0) + h * (flux_in - flux[0]);
+    for (int i = 1; i < size; i++) out[i] = (base ? base[i] : 0) + h * (flux[i - 1] - flux[i]);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma")))
+static double flux_avx2(const double* agg, double* flux, int size, double ke_am, double kem) {
+    __m256d forward = _mm256_set1_pd(ke_am);
+    __m256d backward = _mm256_set1_pd(kem);
+    __m256d sum = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 < size; i += 4) {
+        __m256d J = _mm256_fmsub_pd(forward, _mm256_loadu_pd(agg + i), _mm256_mul_pd(backward, _mm256_loadu_pd(agg + i + 1)));
+        _mm256_storeu_pd(flux + i, J);
+        sum = _mm256_add_pd(sum, J);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sum);
+    double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < size - 1; i++) {
+        flux[i] = ke_am * agg[i] - kem * agg[i + 1];
+        total += flux[i];
+    }
+    flux[size - 1] = ke_am * agg[size - 1];
+    return total + flux[size - 1];
+}
+
+__attribute__((target("avx2,fma")))
+static void apply_avx2(const double* base, const double* flux, double* out, int size, double h, double flux_in) {
+    __m256d step = _mm256_set1_pd(h);
+    out[0] = (base ? base[0] : 0) + h * (flux_in - flux[0]);
+    int i = 1;
+    if (base) {
+        for (; i + 4 <= size; i += 4) {
+            __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(flux + i - 1), _mm256_loadu_pd(flux + i));
+            _mm256_storeu_pd(out + i, _mm256_fmadd_pd(step, diff, _mm256_loadu_pd(base + i)));
+        }
+    } else {
+        for (; i + 4 <= size; i += 4) {
+            __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(flux + i - 1), _mm256_loadu_pd(flux + i));
+            _mm256_storeu_pd(out + i, _mm256_mul_pd(step, diff));
+        }
+    }
+    for (; i < size; i++) out[i] = (base ? base[i] : 0) + h * (flux[i - 1] - flux[i]);
+}
+
+__attribute__((target("avx512f")))
+static double flux_avx512(const double* agg, double* flux, int size, double ke_am, double kem) {
+    __m512d forward = _mm512_set1_pd(ke_am);
+    __m512d backward = _mm512_set1_pd(kem);
+    __m512d sum = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 8 < size; i += 8) {
+        __m512d J = _mm512_fmsub_pd(forward, _mm512_loadu_pd(agg + i), _mm512_mul_pd(backward, _mm512_loadu_pd(agg + i + 1)));
+        _mm512_storeu_pd(flux + i, J);
+        sum = _mm512_add_pd(sum, J);
+    }
+    // added in the order _mm512_reduce_add_pd uses, without its undefined-vector warning
+    double lanes[8];
+    _mm512_storeu_pd(lanes, sum);
+    double total = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+    for (; i < size - 1; i++) {
+        flux[i] = ke_am * agg[i] - kem * agg[i + 1];
+        total += flux[i];
+    }
+    flux[size - 1] = ke_am * agg[size - 1];
+    return total + flux[size - 1];
+}
+
+__attribute__((target("avx512f")))
+static void apply_avx512(const double* base, const double* flux, double* out, int size, double h, double flux_in) {
+    __m512d step = _mm512_set1_pd(h);
+    out[0] = (base ? base[0] : 0) + h * (flux_in - flux[0]);
+    int i = 1;
+    if (base) {
+        for (; i + 8 <= size; i += 8) {
+            __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(flux + i - 1), _mm512_loadu_pd(flux + i));
+            _mm512_storeu_pd(out + i, _mm512_fmadd_pd(step, diff, _mm512_loadu_pd(base + i)));
+        }
+    } else {
+        for (; i + 8 <= size; i += 8) {
+            __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(flux + i - 1), _mm512_loadu_pd(flux + i));
+            _mm512_storeu_pd(out + i, _mm512_mul_pd(step, diff));
+        }
+    }
+    for (; i < size; i++) out[i] = (base ? base[i] : 0) + h * (flux[i - 1] - flux[i]);
+}
+#endif
+
+// Picks the widest kernel the cpu runs, KINETICS_SIMD=scalar|avx2|avx512 caps it
+static std::string simd_level() {
+    std::string cap = std::getenv("KINETICS_SIMD") ? std::getenv("KINETICS_SIMD") : "";
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (cap != "scalar" && cap != "avx2" && __builtin_cpu_supports("avx512f")) return "avx512";
+    if (cap != "scalar" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return "avx2";
+#endif
+    return "scalar";
+}
+static const std::string SIMD_LEVEL = simd_level();
+template<typename T> struct ChainKernels {
+    static FluxKernel flux() {
+        return flux_scalar<T>;
+    };
+    static ApplyKernel apply() {
+        return apply_scalar<T>;
+    };
+};
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+template<> struct ChainKernels<double> {
+    typedef double (*Flux)(const double*, double*, int, double, double);
+    typedef void (*Apply)(const double*, const double*, double*, int, double, double);
+    static Flux flux() {
+        return SIMD_LEVEL == "avx512" ? flux_avx512 : SIMD_LEVEL == "avx2" ? flux_avx2 : flux_scalar<double>;
+    };
+    static Apply apply() {
+        return SIMD_LEVEL == "avx512" ? apply_avx512 : SIMD_LEVEL == "avx2" ? apply_avx2 : apply_scalar<double>;
+    };
+};
+#endif
+static const FluxKernel chain_flux = ChainKernels<real>::flux();
+static const ApplyKernel chain_apply = ChainKernels<real>::apply();
+
+// Per-thread scratch for the flux array
+static real* flux_buffer(int size) {
+    thread_local std::vector<real> buffer;
+    if (buffer.size() < size) buffer.resize(size);
+    return buffer.data();
+}
+
+// Net elongation fluxes of A into flux, weighted between bins
+static double elongation_flux(Conditions& A, real* flux, Params& params) {
     int agg_size = A.agg.size();
-    B.agg.resize(A.agg.size() + 1);
-    double diff = 0;
-	double shared_diff = 0; // calculating im
-    shared_diff = -(A.im * params.forward[0]) + (A.am * params.backward[0]);
-    B.im = A.im + step_size * diff;
-
-	// calculating am
-    diff = -shared_diff; // Any increase/decrease in im is mirrored in am
-	// That replaces next 2 lines
-    // diff += A.im * params.forward[0];
-    // diff -= A.am * params.backward[0];
-    shared_diff = - (params.n * std::pow(A.am, params.r) * params.forward[1]);
-    shared_diff += params.n * A.agg[0] * params.backward[1];
-    for (int i = 0; i < agg_size - 1; i++) {
-        diff -= A.am * A.agg[i] * params.forward[2];
-        diff += A.agg[i + 1] * params.backward[2];
-    }
-    diff -= A.am * A.agg[agg_size - 1] * params.forward[2];
-	diff += shared_diff;
-    B.am = A.am + step_size * diff;
-
-    diff = - shared_diff / params.n; // calculating first aggregate
-	// That replaces next two lines
-    // diff += std::pow(A.am, params.r) * params.forward[1];
-    // diff -= A.agg[0] * params.backward[1];
-	shared_diff = 0;
-    shared_diff -= A.am * A.agg[0] * params.forward[2];
-    shared_diff += A.agg[1] * params.backward[2];
-	diff += shared_diff;
-    B.agg[0] = A.agg[0] + step_size * diff;
-
-    for (int i = 1; i < agg_size - 1; i++) {
-        diff = - shared_diff; // calculating intermediate aggregates
-        // diff += A.am * A.agg[i - 1] * params.forward[2];
-        // diff -= A.agg[i] * params.backward[2];
-		shared_diff = 0;
-        shared_diff -= A.am * A.agg[i] * params.forward[2];
-        shared_diff += A.agg[i + 1] * params.backward[2];
-		diff += shared_diff;
-        B.agg[i] = A.agg[i] + step_size * diff;
-    }
-
-    diff = - shared_diff; // calculating last aggregate
-    // diff += A.am * A.agg[agg_size - 2] * params.forward[2];
-    // diff -= A.agg[agg_size - 1] * params.backward[2];
-	shared_diff = - A.am * A.agg[agg_size - 1] * params.forward[2];
-    diff += A.am * A.agg[agg_size - 1] * params.forward[2];
-    B.agg[agg_size - 1] = A.agg[agg_size - 1] + step_size * diff;
-
-    diff = - shared_diff; // calculating next aggregate
-    // diff += A.am * A.agg[agg_size - 1] * params.forward[2];
-    B.agg[agg_size] = step_size * diff;
+    if (bins.active()) return flux_weighted(A.agg.data(), flux, agg_size, A.am * params.forward[2], params.backward[2], bins.weights.data());
+    return chain_flux(A.agg.data(), flux, agg_size, A.am * params.forward[2], params.backward[2]);
+}
+
+// Monomers taken up by the aggregates leaving past the last entry, plus the
+// mass those aggregates carry out of the chain
+static double chain_leak(Conditions& A, real* flux, Params& params) {
+    int last = A.agg.size() - 1;
+    return params.forward[2] * A.am * A.agg[last] + (params.n + bins.size(last)) * flux[last];
+}
 
+template<int R> void become_next_order(Conditions& A, Conditions& B, Params& params, double step_size) {
+    int agg_size = A.agg.size();
+    bool grows = !bins.active() || agg_size < bins.count(); // the binned chain stops at its last bin
+    B.agg.resize(agg_size + grows);
+    double activation = A.im * params.forward[0] - A.am * params.backward[0];
+    double nucleation = order_power<R>(A.am, params.r) * params.forward[1] - A.agg[0] * params.backward[1];
+    real* flux = flux_buffer(agg_size);
+    double elongation = elongation_flux(A, flux, params);
+    chain_apply(A.agg.data(), flux, B.agg.data(), agg_size, step_size, nucleation);
+    if (grows) B.agg[agg_size] = step_size * flux[agg_size - 1]; // the chain grows by one size
+    B.im = A.im - step_size * activation;
+    B.am = A.am + step_size * (activation - params.n * nucleation - elongation);
+    B.count = A.count + step_size * (nucleation - (grows ? 0 : flux[agg_size - 1]));
+    B.mass = A.mass + step_size * (params.n * nucleation + elongation - (grows ? 0 : chain_leak(A, flux, params)));
 
     while (B.agg.size() > 2 && B.agg[B.agg.size() - 1] == 0) B.agg.pop_back();
 
     return;
 }
 
-class Concentrations {
+typedef void (*EulerKernel)(Conditions& A, Conditions& B, Params& params, double step_size);
+static const EulerKernel EULER_KERNELS[] = {become_next_order<0>, become_next_order<1>, become_next_order<2>, become_next_order<3>, become_next_order<4>, become_next_order<5>, become_next_order<6>, become_next_order<7>, become_next_order<8>};
+
+void become_next(Conditions& A, Conditions& B, Params& params, double step_size) {
+    EULER_KERNELS[order_index(params.r)](A, B, params, step_size);
+}
+
+// Time derivative of every species for a chain of fixed length, flux past the
+// last aggregate leaves the chain like the trimming in Conditions::next
+template<int R> void rates_order(Conditions& A, Conditions& dA, Params& params) {
+    int agg_size = A.agg.size();
+    dA.agg.resize(agg_size);
+    double activation = A.im * params.forward[0] - A.am * params.backward[0];
+    double nucleation = order_power<R>(A.am, params.r) * params.forward[1] - A.agg[0] * params.backward[1];
+    real* flux = flux_buffer(agg_size);
+    double elongation = elongation_flux(A, flux, params);
+    chain_apply(nullptr, flux, dA.agg.data(), agg_size, 1, nucleation);
+    dA.im = -activation;
+    dA.am = activation - params.n * nucleation - elongation;
+    dA.count = nucleation - flux[agg_size - 1];
+    dA.mass = params.n * nucleation + elongation - chain_leak(A, flux, params);
+}
+
+typedef void (*RatesKernel)(Conditions& A, Conditions& dA, Params& params);
+static const RatesKernel RATES_KERNELS[] = {rates_order<0>, rates_order<1>, rates_order<2>, rates_order<3>, rates_order<4>, rates_order<5>, rates_order<6>, rates_order<7>, rates_order<8>};
+
+void rates(Conditions& A, Conditions& dA, Params& params) {
+    RATES_KERNELS[order_index(params.r)](A, dA, params);
+}
+
+// Derivative of rates() along a state direction V and a parameter direction P,
+// out = J(A) V + (d rates / d params) P, for sensitivity equations
+void rates_tangent(Conditions& A, Conditions& V, Params& params, Params& P, Conditions& out) {
+    int agg_size = A.agg.size();
+    out.agg.resize(agg_size);
+    double activation = P.forward[0] * A.im + params.forward[0] * V.im - P.backward[0] * A.am - params.backward[0] * V.am;
+    double power = 0, dpower = 0; // am^r and its derivative
+    if (A.am > 0) {
+        power = nucleation_power(A.am, params.r);
+        dpower = params.r * power / A.am * V.am + P.r * power * std::log(A.am);
+    } else if (params.r == 1) {
+        dpower = V.am;
+    } else if (params.r == 0) {
+        power = 1;
+    }
+    double nucleation = nucleation_power(A.am, params.r) * params.forward[1] - A.agg[0] * params.backward[1];
+    double dnucleation = P.forward[1] * power + params.forward[1] * dpower - P.backward[1] * A.agg[0] - params.backward[1] * V.agg[0];
+    double ke_am = params.forward[2] * A.am;
+    double dke_am = P.forward[2] * A.am + params.forward[2] * V.am;
+    double elongation = 0;
+    double inflow = dnucleation;
+    for (int i = 0; i < agg_size; i++) {
+        double flux = dke_am * A.agg[i] + ke_am * V.agg[i];
+        if (i + 1 < agg_size) flux -= P.backward[2] * A.agg[i + 1] + params.backward[2] * V.agg[i + 1];
+        out.agg[i] = inflow - flux * bins.weight(i);
+        elongation += flux;
+        inflow = flux * bins.weight(i);
+    }
+    out.im = -activation;
+    out.am = activation - P.n * nucleation - params.n * dnucleation - elongation;
+}
+
+// LU of (I - c * J), where the Jacobian J is tridiagonal over the aggregate
+// chain plus a dense am row and column and the im/am corner
+class Factorization {
     public:
-        std::vector<double> times;
-        std::vector<Conditions> conditions;
-        Concentrations() 
-            : times(), conditions() {};
-        Concentrations(Conditions& initial, Params& params, double time_length, double step_size)
-            : times(), conditions()
-        {
-            int len = time_length / step_size + 2;
-            times.resize(len);
-            conditions.resize(len);
-            conditions[0] = initial;
-            times[0] = 0;
-            for (int pos = 1; pos < len; pos++) {
-                conditions[pos] = conditions[pos - 1].next(params, step_size);
-                times[pos] = times[pos - 1] + step_size;
-            }
-        };
-        Concentrations(const Concentrations &orig)
-            : conditions(orig.conditions), times(orig.times) {};
-        void print(std::string& file_name) {
-            std::ofstream output;
-            output.open(file_name, std::ofstream::out | std::ofstream::trunc);
-            for (int i = 0; i < times.size(); i++) {
-                output << times[i] << ',' << conditions[i].im << ',' << conditions[i].am << ',';
-                for (int j = 0; j < conditions[i].agg.size() - 1; j++) {
-                    output << conditions[i].agg[j] << ',';
-                }
-                output << conditions[i].agg[conditions[i].agg.size() - 1] << '\n';
+        void factor(Conditions& A, Params& params, double c) {
+            int agg_size = A.agg.size();
+            double ke_am = params.forward[2] * A.am;
+            double kem = params.backward[2];
+            double dnuc = 0; // d(am^r)/d(am)
+            if (A.am > 0) dnuc = params.r * nucleation_power(A.am, params.r - 1);
+            else if (params.r == 1) dnuc = 1;
+            double total = A.count;
+
+            lower.resize(agg_size);
+            upper.resize(agg_size);
+            pivot.resize(agg_size);
+            ratio.resize(agg_size);
+            column.resize(agg_size);
+            row.resize(agg_size);
+            for (int i = 0; i < agg_size; i++) {
+                double w = bins.weight(i), w_in = i == 0 ? 1 : bins.weight(i - 1);
+                lower[i] = -c * w_in * ke_am;
+                upper[i] = -c * w * kem;
+                double diag = 1 + c * (w * ke_am + (i == 0 ? params.backward[1] : w_in * kem));
+                pivot[i] = i == 0 ? diag : diag - lower[i] * ratio[i - 1];
+                ratio[i] = upper[i] / pivot[i];
             }
-            output.close();
+
+            column[0] = -c * (params.forward[1] * dnuc - params.forward[2] * bins.weight(0) * A.agg[0]);
+            row[0] = -c * (params.n * params.backward[1] - ke_am);
+            for (int i = 1; i < agg_size; i++) {
+                column[i] = -c * params.forward[2] * (bins.weight(i - 1) * A.agg[i - 1] - bins.weight(i) * A.agg[i]);
+                row[i] = -c * (kem - ke_am);
+            }
+            tridiagonal(column);
+
+            m_ii = 1 + c * params.forward[0];
+            m_ia = -c * params.backward[0];
+            m_ai = -c * params.forward[0];
+            schur = 1 + c * (params.backward[0] + params.n * params.forward[1] * dnuc + params.forward[2] * total);
+            for (int i = 0; i < agg_size; i++) schur -= row[i] * column[i];
+
+            // moment rows, which nothing else depends on
+            int last = agg_size - 1;
+            double leaving = params.forward[2] * bins.weight(last);
+            double carried = params.forward[2] * (1 + (params.n + bins.size(last)) * bins.weight(last));
+            count_am = c * (params.forward[1] * dnuc - leaving * A.agg[last]);
+            count_first = -c * params.backward[1];
+            count_last = -c * leaving * A.am;
+            mass_am = c * (params.n * params.forward[1] * dnuc + params.forward[2] * total - carried * A.agg[last]);
+            mass_first = c * (kem - params.n * params.backward[1]);
+            mass_sum = c * (ke_am - kem);
+            mass_last = -c * carried * A.am;
+        };
+        // Overwrites B with the solution of (I - c * J) X = B
+        void solve(Conditions& B) {
+            tridiagonal(B.agg);
+            double am_rhs = B.am;
+            for (int i = 0; i < B.agg.size(); i++) am_rhs -= row[i] * B.agg[i];
+            double det = m_ii * schur - m_ia * m_ai;
+            double x_im = (B.im * schur - m_ia * am_rhs) / det;
+            double x_am = (m_ii * am_rhs - m_ai * B.im) / det;
+            double sum = 0;
+            for (int i = 0; i < B.agg.size(); i++) {
+                B.agg[i] -= x_am * column[i];
+                sum += B.agg[i];
+            }
+            int last = B.agg.size() - 1;
+            B.count += count_am * x_am + count_first * B.agg[0] + count_last * B.agg[last];
+            B.mass += mass_am * x_am + mass_first * B.agg[0] + mass_sum * sum + mass_last * B.agg[last];
+            B.im = x_im;
+            B.am = x_am;
+        };
+    private:
+        std::vector<double> lower; // tridiagonal chain block, row i holds lower[i], pivot, upper[i]
+        std::vector<double> upper;
+        std::vector<double> pivot;
+        std::vector<double> ratio;
+        std::vector<double> column; // chain block applied to the am column
+        std::vector<double> row;
+        double m_ii, m_ia, m_ai, schur;
+        double count_am, count_first, count_last, mass_am, mass_first, mass_sum, mass_last;
+        template<typename T> void tridiagonal(std::vector<T>& b) {
+            int size = b.size();
+            b[0] /= pivot[0];
+            for (int i = 1; i < size; i++) b[i] = (b[i] - lower[i] * b[i - 1]) / pivot[i];
+            for (int i = size - 2; i >= 0; i--) b[i] -= ratio[i] * b[i + 1];
         };
 };
 
-class Masses {
+enum class LogLevel { quiet, info, debug };
+static LogLevel log_level = LogLevel::info; // debug adds every Nelder-Mead point and error to the output
+
+bool logging(LogLevel level) {
+    return level <= log_level;
+}
+
+enum class Operation { reflect, expand, contract, shrink };
+static const char* OPERATION_NAMES[] = {"reflect", "expand", "contract", "shrink"};
+
+// Run counters, appended as one JSON line per interval to the file given to
+// start. Until then every update is skipped behind a single branch.
+class Metrics {
     public:
-        std::vector<double> times;
-        std::vector<double> masses;
-        Masses()
-            : times(), masses() {};
-        Masses(std::vector<double> times, std::vector<double> masses)
-            : times(times), masses(masses) {};
-        Masses(Conditions initial, Params params, double time_length, double step_size, int points = DEFAULT_POINTS)
-            : times(), masses()
-        {
-            double push_next = time_length / points;
-            double display_steps = 100;
-            double display_next = 0;
-            std::cout << "Generating Mass" << std::endl;
-            double time = 0;
-            times.reserve(points);
-            masses.reserve(points);
-            masses.push_back(initial.agg_mass(params));
-            times.push_back(time);
-            Conditions next;
-			Conditions temp;
-            for (double step = 0; step < time_length; step += step_size) {
-                become_next(initial, next, params, step_size);
-				temp = std::move(initial);
-				initial = std::move(next);
-				next = std::move(temp);
-                time += step_size;
-                if (step > push_next) {
-                    masses.push_back(initial.agg_mass(params));
-                    times.push_back(time);
-                    push_next += time_length / points;
-                }
-                if (step > display_next) {
-                    std::cout << "\r" << "[" << std::string((int) display_steps * step / time_length, (char)254u) << std::string(display_steps - (int) (display_steps * step / time_length), ' ') << "]";
-                    std::cout.flush();
-                    display_next += time_length / display_steps;
+        bool enabled;
+        std::atomic<long> steps;
+        std::atomic<long> rejected;
+        std::atomic<long> evaluations; // calc_error and lm_residuals calls
+        std::atomic<long> cached;
+        std::atomic<long> aborted;
+        std::atomic<long> sensitivities;
+        std::atomic<long> chain; // occupied aggregate length after the latest advance
+        std::atomic<long> longest_chain;
+        std::atomic<long> resynced; // mass samples whose moments drifted from the full sums
+        std::atomic<long> settled; // runs that reached steady state before their end
+        std::atomic<long> operations[4];
+        std::atomic<long> nanoseconds[4];
+        Metrics()
+            : enabled(false), steps(0), rejected(0), evaluations(0), cached(0), aborted(0), sensitivities(0), chain(0), longest_chain(0), resynced(0), settled(0),
+              operations(), nanoseconds(), stopping(false) {};
+        ~Metrics() {
+            stop();
+        };
+        void start(const std::string& name, double interval) {
+            output.open(name, std::ofstream::out | std::ofstream::app);
+            if (!output) throw std::runtime_error("Cannot write metrics to " + name);
+            started = std::chrono::steady_clock::now();
+            enabled = true;
+            writer = std::thread([this, interval]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!wake.wait_for(lock, std::chrono::duration<double>(interval), [this]() { return stopping; })) write();
+            });
+        };
+        // Writes a last line with the final totals
+        void stop() {
+            if (!enabled) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            writer.join();
+            write();
+            enabled = false;
+        };
+        void integrated(long steps, long rejected, std::vector<real>& agg) {
+            this->steps += steps;
+            this->rejected += rejected;
+            long length = agg.size();
+            while (length > 0 && agg[length - 1] == 0) length--;
+            chain = length;
+            long longest = longest_chain;
+            while (length > longest && !longest_chain.compare_exchange_weak(longest, length));
+        };
+        // Times the enclosing scope and counts it as operation, which the
+        // scope may change before it ends
+        class Timer {
+            public:
+                Operation operation;
+                Timer(Metrics& metrics, Operation operation)
+                    : operation(operation), metrics(metrics)
+                {
+                    if (metrics.enabled) started = std::chrono::steady_clock::now();
+                };
+                ~Timer() {
+                    if (!metrics.enabled) return;
+                    int i = (int) operation;
+                    metrics.operations[i]++;
+                    metrics.nanoseconds[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+                };
+            private:
+                Metrics& metrics;
+                std::chrono::steady_clock::time_point started;
+        };
+    private:
+        std::ofstream output;
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+        std::chrono::steady_clock::time_point started;
+        void write() {
+            char line[1024];
+            int length = std::snprintf(line, sizeof(line),
+                    "{\"seconds\": %.3f, \"steps\": %ld, \"rejected\": %ld, \"evaluations\": %ld, \"cached\": %ld, \"aborted\": %ld, \"sensitivities\": %ld, \"chain\": %ld, \"longest_chain\": %ld, \"resynced\": %ld, \"settled\": %ld",
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(),
+                    steps.load(), rejected.load(), evaluations.load(), cached.load(), aborted.load(), sensitivities.load(), chain.load(), longest_chain.load(), resynced.load(), settled.load());
+            for (int i = 0; i < 4; i++) {
+                length += std::snprintf(line + length, sizeof(line) - length, ", \"%s\": {\"count\": %ld, \"seconds\": %.6f}",
+                        OPERATION_NAMES[i], operations[i].load(), nanoseconds[i].load() * 1e-9);
+            }
+            output << line << "}\n";
+            output.flush();
+        };
+};
+
+static Metrics metrics;
+
+enum class Method { euler, rk45, ros2 };
+
+class Integrator {
+    public:
+        Method method;
+        double step_size; // fixed step for euler, first trial step otherwise
+        double rtol;
+        double atol;
+        bool aligned; // fits sample at the data times, and euler steps are clipped to land on them
+        double drift; // relative moment drift that resets the moments from the full sums, 0 skips the check
+        double steady; // relative change over the window that counts as steady state, 0 integrates to the end
+        double window; // part of the run length
+        long steps;
+        long rejected;
+        bool diverged; // an adaptive run went non-finite even at the smallest step, or ran past STEP_LIMIT; it then jumps to its end
+        Integrator(double step_size, Method method = Method::euler, double rtol = DEFAULT_RTOL, double atol = DEFAULT_ATOL)
+            : method(method), step_size(step_size), rtol(rtol), atol(atol), aligned(false), drift(0), steady(0), window(STEADY_WINDOW),
+              steps(0), rejected(0), diverged(false), sensitivities(nullptr), directions(nullptr), cancel(nullptr), h(step_size), calm(INFINITY) {};
+        // Adaptive state a checkpoint needs to continue a run exactly
+        double trial_step() {
+            return h;
+        };
+        double calm_since() {
+            return calm;
+        };
+        void resume(double trial_step, long steps, long rejected, double calm_since) {
+            h = trial_step;
+            this->steps = steps;
+            this->rejected = rejected;
+            calm = calm_since;
+        };
+        // With ros2, also carries d state / d params along each direction
+        // through every accepted step
+        void track(std::vector<Conditions>* sensitivities, std::vector<Params>* directions) {
+            this->sensitivities = sensitivities;
+            this->directions = directions;
+        };
+        // Once *cancel is set, every step jumps straight to its limit
+        void watch(const std::atomic<bool>* cancel) {
+            this->cancel = cancel;
+        };
+        // Takes one accepted step without passing limit. A step whose error or
+        // result is not finite is never accepted; once even the smallest step
+        // fails that way the run is marked diverged and time set to limit.
+        void step(Conditions& state, Params& params, double& time, double limit) {
+            if (cancel && *cancel) {
+                time = limit;
+                return;
+            }
+            if (method == Method::euler) {
+                bool clipped = aligned && limit - time < step_size;
+                become_next(state, next, params, clipped ? limit - time : step_size);
+                state.swap(next);
+                time = clipped ? limit : time + step_size;
+                steps++;
+                return;
+            }
+            int length = chain_length(state, params);
+            if (state.agg.size() != length) {
+                state.agg.resize(length);
+                for (int p = 0; sensitivities && p < sensitivities->size(); p++) (*sensitivities)[p].agg.resize(length);
+            }
+            double h_min = 1e-12 * (time + step_size);
+            while (true) {
+                if (diverged || steps >= STEP_LIMIT) {
+                    diverged = true;
+                    time = limit;
+                    return;
+                }
+                bool clipped = h >= limit - time;
+                double dt = clipped ? limit - time : h;
+                double err = method == Method::ros2 ? ros2(state, params, dt) : rk45(state, params, dt);
+                if (!std::isfinite(err) || !next.finite()) err = INFINITY;
+                double order = method == Method::ros2 ? 2 : 5;
+                double factor = err == 0 ? 5 : std::min(5.0, std::max(0.2, 0.9 * std::pow(err, -1 / order)));
+                if (err <= 1 || (dt <= h_min && err < INFINITY)) {
+                    if (sensitivities) ros2_sensitivities(state, params, dt);
+                    state.swap(next);
+                    time = clipped ? limit : time + dt;
+                    steps++;
+                    h = std::max(clipped ? std::max(h, dt * factor) : dt * factor, h_min);
+                    return;
                 }
+                if (dt <= h_min) diverged = true;
+                rejected++;
+                h = std::max(dt * factor, h_min);
+            }
+        };
+        void advance(Conditions& state, Params& params, double& time, double target) {
+            long before = steps, lost = rejected;
+            while (target - time > 1e-9 * step_size) step(state, params, time, target);
+            if (metrics.enabled) metrics.integrated(steps - before, rejected - lost, state.agg);
+        };
+        // Aggregate mass of a measured state, from its first moment
+        double mass(Conditions& state, Params& params) {
+            if (drift > 0) {
+                double sum = state.agg_mass(params);
+                if (std::fabs(state.mass - sum) > drift * std::fabs(sum)) {
+                    if (metrics.enabled) metrics.resynced++;
+                    state.measure(params);
+                }
+            }
+            return state.mass;
+        };
+        // Checked at each sample of a run of this length. True once im, am
+        // and the aggregate chain (by sum (n + size) |agg'| against its
+        // mass) would each have changed by less than steady of themselves
+        // over the window, at every check for a whole window; the caller
+        // then stops integrating.
+        bool settled(Conditions& state, Params& params, double time, double length) {
+            if (steady <= 0) return false;
+            rates(state, k[0], params);
+            double turnover = 0;
+            for (int i = 0; i < state.agg.size(); i++) turnover += (params.n + bins.size(i)) * std::fabs(k[0].agg[i]);
+            double span = window * length;
+            if (!(std::fabs(k[0].im) * span <= steady * std::fabs(state.im) + atol && std::fabs(k[0].am) * span <= steady * std::fabs(state.am) + atol
+                    && turnover * span <= steady * std::fabs(state.mass) + atol)) {
+                calm = INFINITY;
+                return false;
+            }
+            calm = std::min(calm, time);
+            if (time - calm < window * length) return false;
+            if (metrics.enabled) metrics.settled++;
+            return true;
+        };
+    private:
+        std::vector<Conditions>* sensitivities;
+        std::vector<Params>* directions;
+        const std::atomic<bool>* cancel;
+        double h;
+        double calm; // first check of the current run of steady ones
+        Conditions next;
+        Conditions k[7];
+        Conditions tmp;
+        Factorization lu;
+        Conditions s_k0;
+        Conditions s_k1;
+        Conditions s_tmp;
+        // bins.limit() entries; without bins the chain then grows by ARRAY_LIMIT
+        // sizes whenever its last size holds more than the tolerances allow,
+        // so flux past the end stays negligible as with euler's growing chain
+        int chain_length(Conditions& state, Params& params) {
+            int size = state.agg.size();
+            if (bins.active() || size < ARRAY_LIMIT) return bins.limit();
+            double tail = std::fabs(state.agg[size - 1]) * (params.n + size - 1);
+            return tail > atol + rtol * std::fabs(state.mass) ? size + ARRAY_LIMIT : size;
+        };
+        // out = y + dt * sum(coef[s] * k[s])
+        void combine(Conditions& out, Conditions& y, double dt, const double* coef, int count) {
+            out.agg.resize(y.agg.size());
+            out.im = y.im;
+            out.am = y.am;
+            out.count = y.count;
+            out.mass = y.mass;
+            for (int i = 0; i < y.agg.size(); i++) out.agg[i] = y.agg[i];
+            for (int s = 0; s < count; s++) {
+                if (coef[s] == 0) continue;
+                double c = dt * coef[s];
+                out.im += c * k[s].im;
+                out.am += c * k[s].am;
+                out.count += c * k[s].count;
+                out.mass += c * k[s].mass;
+                for (int i = 0; i < y.agg.size(); i++) out.agg[i] += c * k[s].agg[i];
+            }
+        };
+        double scaled(double err, double before, double after) {
+            return std::fabs(err) / (atol + rtol * std::max(std::fabs(before), std::fabs(after)));
+        };
+        // Max-norm of the local error estimate dt * sum(coef[s] * k[s]) against
+        // the tolerances, the moments follow the chain and are left out
+        double error_norm(Conditions& y, const double* coef, int count, double dt) {
+            double e_im = 0;
+            double e_am = 0;
+            for (int s = 0; s < count; s++) {
+                e_im += coef[s] * k[s].im;
+                e_am += coef[s] * k[s].am;
+            }
+            double err = std::max(scaled(dt * e_im, y.im, next.im), scaled(dt * e_am, y.am, next.am));
+            for (int i = 0; i < y.agg.size(); i++) {
+                double e = 0;
+                for (int s = 0; s < count; s++) e += coef[s] * k[s].agg[i];
+                err = std::max(err, scaled(dt * e, y.agg[i], next.agg[i]));
+            }
+            return err;
+        };
+        // Dormand-Prince 5(4)
+        double rk45(Conditions& y, Params& params, double dt) {
+            static const double a[6][6] = {
+                {1.0 / 5},
+                {3.0 / 40, 9.0 / 40},
+                {44.0 / 45, -56.0 / 15, 32.0 / 9},
+                {19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729},
+                {9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656},
+                {35.0 / 384, 0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84}
+            };
+            static const double e[7] = {71.0 / 57600, 0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40};
+            rates(y, k[0], params);
+            for (int s = 1; s < 6; s++) {
+                combine(tmp, y, dt, a[s - 1], s);
+                rates(tmp, k[s], params);
             }
+            combine(next, y, dt, a[5], 6);
+            rates(next, k[6], params);
+            return error_norm(y, e, 7, dt);
         };
-        Masses(Concentrations& concentrations)
-            : times(concentrations.times), masses()
+        // Two-stage L-stable Rosenbrock method of Verwer et al., the first
+        // order stage gives the error estimate
+        double ros2(Conditions& y, Params& params, double dt) {
+            static const double gamma = 1 + 1 / std::sqrt(2.0);
+            static const double one[1] = {1};
+            static const double b[2] = {1.5, 0.5};
+            static const double e[2] = {0.5, 0.5};
+            lu.factor(y, params, gamma * dt);
+            rates(y, k[0], params);
+            lu.solve(k[0]);
+            combine(tmp, y, dt, one, 1);
+            rates(tmp, k[1], params);
+            k[1].im -= 2 * k[0].im;
+            k[1].am -= 2 * k[0].am;
+            k[1].count -= 2 * k[0].count;
+            k[1].mass -= 2 * k[0].mass;
+            for (int i = 0; i < y.agg.size(); i++) k[1].agg[i] -= 2 * k[0].agg[i];
+            lu.solve(k[1]);
+            combine(next, y, dt, b, 2);
+            return error_norm(y, e, 2, dt);
+        };
+        // The same ROS2 stages on the sensitivity equations S' = J S + df/dp,
+        // reusing the state's factorization and stage point. Leaving the
+        // d(J S)/d state coupling out of the matrix keeps the solves
+        // block-diagonal, and ROS2 keeps its order as a W-method.
+        void ros2_sensitivities(Conditions& y, Params& params, double dt) {
+            for (int p = 0; p < sensitivities->size(); p++) {
+                Conditions& S = (*sensitivities)[p];
+                Params& P = (*directions)[p];
+                rates_tangent(y, S, params, P, s_k0);
+                lu.solve(s_k0);
+                s_tmp.agg.resize(S.agg.size());
+                s_tmp.im = S.im + dt * s_k0.im;
+                s_tmp.am = S.am + dt * s_k0.am;
+                for (int i = 0; i < S.agg.size(); i++) s_tmp.agg[i] = S.agg[i] + dt * s_k0.agg[i];
+                rates_tangent(tmp, s_tmp, params, P, s_k1);
+                s_k1.im -= 2 * s_k0.im;
+                s_k1.am -= 2 * s_k0.am;
+                for (int i = 0; i < S.agg.size(); i++) s_k1.agg[i] -= 2 * s_k0.agg[i];
+                lu.solve(s_k1);
+                S.im += dt * (1.5 * s_k0.im + 0.5 * s_k1.im);
+                S.am += dt * (1.5 * s_k0.am + 0.5 * s_k1.am);
+                for (int i = 0; i < S.agg.size(); i++) S.agg[i] += dt * (1.5 * s_k0.agg[i] + 0.5 * s_k1.agg[i]);
+            }
+        };
+};
+
+// Persistent workers; a thread waiting in run() executes queued tasks itself,
+// so tasks may call run() again without starving the pool. An exception from
+// a task of run() is held until every task has finished, then rethrown there.
+class ThreadPool {
+    public:
+        ThreadPool(unsigned int count)
+            : stopping(false)
         {
-            masses.resize(concentrations.conditions.size());
-            for (int i = 0; i < concentrations.conditions.size(); i++) {
-                masses[i] = concentrations.conditions[i].agg.size();
+            for (unsigned int i = 1; i < std::max(count, 1u); i++) {
+                workers.push_back(std::thread([this]() { work(); }));
             }
         };
-        Masses(const Masses &orig)
-            : times(orig.times), masses(orig.masses) {};
-        void print(std::string file_name) {
-            std::ofstream output;
-            output.open(file_name, std::ofstream::out | std::ofstream::trunc);
-            for (int i = 0; i < times.size(); i++) {
-                output << times[i] << ',' << masses[i] << '\n';
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
             }
-            output.close();
+            wake.notify_all();
+            for (int i = 0; i < workers.size(); i++) workers[i].join();
         };
-        Masses(std::string& csv) {
-            std::stringstream csv_stream(csv);
-            std::string line;
-            std::stringstream line_stream;
-            std::string val;
-            while (csv_stream >> line) {
-                line_stream.str(line);
-                std::getline(line_stream, val, ',');
-                times.push_back(std::stod(val));
-                std::getline(line_stream, val, ',');
-                masses.push_back(std::stod(val));
-                line_stream.clear();
+        unsigned int size() {
+            return workers.size() + 1;
+        };
+        // Queues task for the workers and returns at once
+        void post(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(std::move(task));
             }
-        }
-        double get(double time) {
-            int L = 0;
-            int R = times.size() - 1;
-            int m;
-            while (L <= R) {
-                m = (L + R) / 2;
-                if (times[m] < time) {
-                    L = m + 1;
-                } else if (times[m] > time) {
-                    R = m - 1;
-                } else return masses[m];
+            wake.notify_one();
+        };
+        // Runs every task and returns once all of them have finished,
+        // rethrowing the first exception any of them threw
+        void run(std::vector<std::function<void()>>& tasks) {
+            int remaining = tasks.size();
+            std::condition_variable finished;
+            std::exception_ptr failure;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (int i = 0; i < tasks.size(); i++) {
+                    std::function<void()>* task = &tasks[i];
+                    queue.push_back([this, task, &remaining, &finished, &failure]() {
+                        std::exception_ptr caught;
+                        try {
+                            (*task)();
+                        } catch (...) {
+                            caught = std::current_exception();
+                        }
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (caught && !failure) failure = caught;
+                        if (--remaining == 0) finished.notify_all();
+                    });
+                }
             }
-            if (R >= times.size() || L >= times.size()) return masses[times.size() - 1];
-            if (L < 0 || R < 0) return masses[0];
-            return (masses[R] + masses[L]) / 2;
-        }
-        void normalize(double time) {
-            double mass = get(time);
-            for (int i = 0; i < masses.size(); i++) {
-                masses[i] = masses[i] / mass;
+            wake.notify_all();
+            std::unique_lock<std::mutex> lock(mutex);
+            while (remaining > 0) {
+                if (!queue.empty()) {
+                    std::function<void()> task = std::move(queue.front());
+                    queue.pop_front();
+                    lock.unlock();
+                    task();
+                    lock.lock();
+                } else {
+                    finished.wait(lock);
+                }
             }
-        }
+            lock.unlock();
+            if (failure) std::rethrow_exception(failure);
+        };
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> queue;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                std::function<void()> task = std::move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                // run() wraps its own tasks, this only reaches posted ones
+                try {
+                    task();
+                } catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                } catch (...) {
+                    std::cerr << "Task failed" << std::endl;
+                }
+                lock.lock();
+            }
+        };
 };
 
-double MSE(std::vector<Masses>& A, std::vector<Masses>& B) {
-    int counter = 0;
-    double error = 0;
-    for (int i = 0; i < A.size(); i++) {
-        counter += A[i].times.size();
-        for (int j = 0; j < A[i].times.size(); j++) {
-            error += std::pow(B[i].get(A[i].times[j]) - A[i].masses[j], 2);
-        }
-    }
-    return error / counter;
-}
+// Binary columnar files: a BinaryHeader, header.initial_count doubles of the
+// initial condition (im, am, aggregates), then header.columns blocks of
+// header.rows doubles each. Masses files hold the columns time, mass;
+// concentration files hold time, im, am and one column per chain entry up to
+// the longest chain of the run. Values are native-endian float64.
+static const char BINARY_MAGIC[4] = {'K', 'M', 'B', '1'};
+enum BinaryKind : std::uint32_t { MASS_FILE = 0, CONC_FILE = 1 };
 
-double calc_error(Params& params, std::vector<Conditions>& conditions, std::vector<Masses>& real_data, double step_size) {
-    double error;
-    if (params.is_positive()) {
-        std::vector<Masses> model;
-        for (int i = 0; i < conditions.size(); i++) {
-            model.push_back(Masses(conditions[i], params, real_data[i].times[real_data[i].times.size() - 1], step_size));
-            model[i].normalize(real_data[i].times[real_data[i].times.size() - 1]);
-        }
-        error = MSE(real_data, model);
-    } else {
-        error = INFINITY;
+struct BinaryHeader {
+    char magic[4];
+    std::uint32_t kind;
+    std::uint64_t rows;
+    std::uint32_t columns;
+    std::uint32_t initial_count;
+    double step_size;
+    double params[2 + 2 * RATE_CONSTANTS]; // n, r, forward, backward
+};
+
+BinaryHeader make_header(BinaryKind kind, std::uint64_t rows, std::uint32_t columns, Params& params, Conditions& initial, double step_size) {
+    BinaryHeader header;
+    std::memcpy(header.magic, BINARY_MAGIC, 4);
+    header.kind = kind;
+    header.rows = rows;
+    header.columns = columns;
+    header.initial_count = initial.agg.size() + 2;
+    header.step_size = step_size;
+    header.params[0] = params.n;
+    header.params[1] = params.r;
+    for (int i = 0; i < RATE_CONSTANTS; i++) {
+        header.params[2 + i] = params.forward[i];
+        header.params[2 + RATE_CONSTANTS + i] = params.backward[i];
     }
-    return error;
+    return header;
 }
 
-Params globalFit(std::vector<Masses> real_data, std::vector<Params> params_vec, std::vector<Conditions> initials, double step_size) {
-    for (int i = 0; i < real_data.size(); i++) {
-        real_data[i].normalize(real_data[i].times[real_data[i].times.size() - 1]);
-    }
-    std::vector<std::pair<Params,double>> guesses;
-    guesses.resize(params_vec.size());
-    for (int i = 0; i < params_vec.size(); i++) {
-        guesses[i] = std::make_pair(params_vec[i], calc_error(
-                    params_vec[i], initials, real_data, step_size
-                    )
-                );
-        guesses[i].first.print();
-        std::cout << guesses[i].second << std::endl;
-    }
-    for (int i = 0; i < 100; i++) {
-        std::sort(guesses.begin(), guesses.end(),
-                [](std::pair<Params, double> a, std::pair<Params, double> b) {
-                return a.second < b.second;
-                });
-        std::cout << "Ordered guesses" << std::endl;
-        for (int i = 0; i < guesses.size(); i++) {
-            guesses[i].first.print();
-            std::cout << guesses[i].second << std::endl;
-        }
-        // Find the centroid
-        Params centroid;
-        for (int j = 0; j < guesses.size() - 1; j++) {
-            centroid = centroid + guesses[j].first;
-        }
-        centroid = centroid * (1.0 / (guesses.size() - 1));
-        std::cout << "Centroid" << std::endl;
-        centroid.print();
-        // Reflect point
-        Params reflection = centroid + centroid - guesses[guesses.size() - 1].first;
-        std::cout << "Reflection" << std::endl;
-        reflection.print();
-        double refl_error = calc_error(reflection, initials, real_data, step_size);
-        std::cout << "Error: " << refl_error << std::endl;
-        if (refl_error < guesses[guesses.size() - 1].second && refl_error > guesses[0].second) {
-            // Reflection is good
-            guesses[guesses.size() - 1].first = reflection;
-            guesses[guesses.size() - 1].second = refl_error;
-            continue;
-        } else if (refl_error <= guesses[0].second) {
-            // Reflection is reall good, try expanding
-            Params expansion = centroid + ( (reflection - centroid) * 2 );
-            std::cout << "Expansion" << std::endl;
-            expansion.print();
-            double expa_error = calc_error(expansion, initials, real_data, step_size);
-            std::cout << "Error: " << expa_error << std::endl;
-            if (expa_error < refl_error) {
-                guesses[guesses.size() - 1].first = expansion;
-                guesses[guesses.size() - 1].second = expa_error;
-            } else {
-                guesses[guesses.size() - 1].first = reflection;
-                guesses[guesses.size() - 1].second = refl_error;
+// Read-only view of a whole file, memory-mapped where the platform allows
+class MappedFile {
+    public:
+        MappedFile(const std::string& file_name)
+            : address(nullptr), length(0)
+        {
+#if KINETICS_MMAP
+            int fd = open(file_name.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("Cannot open " + file_name);
+            struct stat info;
+            fstat(fd, &info);
+            length = info.st_size;
+            if (length > 0) {
+                void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    close(fd);
+                    throw std::runtime_error("Cannot map " + file_name);
+                }
+                address = (const char*) mapped;
             }
-            continue;
-        }
-        // Reflection is bad, try contraction instead
-        Params in_contraction = centroid + ( (guesses[guesses.size() - 1].first - centroid) * 0.5 );
-        std::cout << "Contraction (inside)" << std::endl;
-        in_contraction.print();
-        double in_cont_error = calc_error(in_contraction, initials, real_data, step_size);
-        std::cout << "Error: " << in_cont_error << std::endl;
-        Params out_contraction = centroid + ( (reflection - centroid) * 0.5 );
-        std::cout << "Contraction (outside)" << std::endl;
-        out_contraction.print();
-        double out_cont_error = calc_error(out_contraction, initials, real_data, step_size);
-        std::cout << "Error: " << out_cont_error << std::endl;
-        if (in_cont_error < guesses[guesses.size() - 1].second) {
+            close(fd);
+#else
+            std::ifstream input(file_name, std::ifstream::in | std::ifstream::binary);
+            if (!input) throw std::runtime_error("Cannot open " + file_name);
+            contents.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            address = contents.data();
+            length = contents.size();
+#endif
+        };
+        ~MappedFile() {
+#if KINETICS_MMAP
+            if (address) munmap((void*) address, length);
+#endif
+        };
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        const char* data() const {
+            return address;
+        };
+        std::size_t size() const {
+            return length;
+        };
+        bool is_binary() const {
+            return length >= sizeof(BinaryHeader) && std::memcmp(address, BINARY_MAGIC, 4) == 0;
+        };
+    private:
+        const char* address;
+        std::size_t length;
+#if !KINETICS_MMAP
+        std::vector<char> contents;
+#endif
+};
+
+// Writes a columnar file of known row count one value at a time, through a
+// shared mapping where the platform allows. Columns can be added as they are
+// needed; each is its own block at the end of the file.
+class ColumnWriter {
+    public:
+        // keep reopens a partly written file instead of starting it over,
+        // along with any columns it was widened to
+        ColumnWriter(const std::string& file_name, BinaryHeader header, Conditions& initial, bool keep = false)
+            : file_name(file_name), rows(header.rows), columns(header.columns), address(nullptr)
+        {
+            offset = sizeof(BinaryHeader) + header.initial_count * sizeof(double);
+            std::vector<double> values;
+            values.push_back(initial.im);
+            values.push_back(initial.am);
+            values.insert(values.end(), initial.agg.begin(), initial.agg.end());
+#if KINETICS_MMAP
+            int fd = open(file_name.c_str(), O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+            BinaryHeader existing;
+            if (fd >= 0 && keep && pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) && existing.rows == rows) {
+                columns = std::max(columns, existing.columns);
+            }
+            header.columns = columns;
+            length = offset + columns * rows * sizeof(double);
+            if (fd < 0 || ftruncate(fd, length) != 0) throw std::runtime_error("Cannot create " + file_name);
+            void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Cannot map " + file_name);
+            address = (char*) mapped;
+            std::memcpy(address, &header, sizeof(header));
+            std::memcpy(address + sizeof(header), values.data(), values.size() * sizeof(double));
+#else
+            length = offset + columns * rows * sizeof(double);
+            if (keep) {
+                output.open(file_name, std::fstream::in | std::fstream::out | std::fstream::binary);
+                BinaryHeader existing;
+                if (output.read((char*) &existing, sizeof(existing)) && existing.rows == rows) {
+                    columns = std::max(columns, existing.columns);
+                    length = offset + columns * rows * sizeof(double);
+                    return;
+                }
+                output.close();
+            }
+            output.open(file_name, std::fstream::out | std::fstream::trunc | std::fstream::binary);
+            output.write((const char*) &header, sizeof(header));
+            output.write((const char*) values.data(), values.size() * sizeof(double));
+            std::vector<char> zeros(OUTPUT_BUFFER, 0);
+            for (std::size_t left = length - offset; left > 0; left -= std::min(left, zeros.size())) {
+                output.write(zeros.data(), std::min(left, zeros.size()));
+            }
+#endif
+        };
+        ~ColumnWriter() {
+#if KINETICS_MMAP
+            if (address) munmap(address, length);
+#endif
+        };
+        void set(std::size_t column, std::size_t row, double value) {
+            std::size_t position = offset + (column * rows + row) * sizeof(double);
+#if KINETICS_MMAP
+            std::memcpy(address + position, &value, sizeof(double));
+#else
+            output.seekp(position);
+            output.write((const char*) &value, sizeof(double));
+#endif
+        };
+        // Zero columns up to count; the header follows
+        void widen(std::uint32_t count) {
+            if (count <= columns) return;
+            std::size_t wider = offset + count * rows * sizeof(double);
+#if KINETICS_MMAP
+            munmap(address, length);
+            address = nullptr;
+            int fd = open(file_name.c_str(), O_RDWR);
+            if (fd < 0 || ftruncate(fd, wider) != 0) throw std::runtime_error("Cannot widen " + file_name);
+            void* mapped = mmap(nullptr, wider, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Cannot map " + file_name);
+            address = (char*) mapped;
+            std::memcpy(address + offsetof(BinaryHeader, columns), &count, sizeof(count));
+#else
+            std::vector<char> zeros(OUTPUT_BUFFER, 0);
+            output.seekp(length);
+            for (std::size_t left = wider - length; left > 0; left -= std::min(left, zeros.size())) {
+                output.write(zeros.data(), std::min(left, zeros.size()));
+            }
+            output.seekp(offsetof(BinaryHeader, columns));
+            output.write((const char*) &count, sizeof(count));
+#endif
+            columns = count;
+            length = wider;
+        };
+        // Everything set so far is on disk once this returns
+        void sync() {
+#if KINETICS_MMAP
+            msync(address, length, MS_SYNC);
+#else
+            output.flush();
+#endif
+        };
+    private:
+        std::string file_name;
+        std::uint64_t rows;
+        std::uint32_t columns;
+        std::size_t offset;
+        std::size_t length;
+        char* address;
+#if !KINETICS_MMAP
+        std::fstream output;
+#endif
+};
+
+// A column of doubles, either owned or viewed inside a MappedFile
+class Column {
+    public:
+        Column()
+            : view(nullptr), count(0) {};
+        Column(std::shared_ptr<MappedFile> file, const double* view, std::size_t count)
+            : view(view), count(count), file(file) {};
+        std::size_t size() const {
+            return view ? count : owned.size();
+        };
+        double operator[](std::size_t i) const {
+            return view ? view[i] : owned[i];
+        };
+        void push_back(double value) {
+            own();
+            owned.push_back(value);
+        };
+        void reserve(std::size_t size) {
+            own();
+            owned.reserve(size);
+        };
+    private:
+        std::vector<double> owned;
+        const double* view;
+        std::size_t count;
+        std::shared_ptr<MappedFile> file;
+        void own() {
+            if (!view) return;
+            owned.assign(view, view + count);
+            view = nullptr;
+            file.reset();
+        };
+};
+
+// Periodic snapshots of a long run, each a flat list of doubles headed by the
+// params row or simplex it belongs to. A snapshot goes to name + ".tmp" and is
+// renamed over name, so a kill mid-write keeps the previous one. When
+// resuming, the saved values are handed back once to the run that wrote them.
+static const char CHECKPOINT_MAGIC[4] = {'K', 'M', 'K', '3'};
+static const double CHECKPOINT_INTERVAL = 60; // seconds
+
+class Checkpoint {
+    public:
+        long row;
+        Checkpoint(const std::string& name, bool resume, double interval = CHECKPOINT_INTERVAL)
+            : row(0), name(name), interval(interval), last(std::chrono::steady_clock::now()), pending(false), position(0)
+        {
+            if (!resume) return;
+            std::ifstream input(name, std::ifstream::in | std::ifstream::binary);
+            char magic[4];
+            std::uint64_t count;
+            if (!input.read(magic, 4) || std::memcmp(magic, CHECKPOINT_MAGIC, 4) != 0 || !input.read((char*) &count, sizeof(count))) {
+                std::cerr << "No checkpoint in " << name << ", starting over" << std::endl;
+                return;
+            }
+            saved.resize(count);
+            if (count == 0 || !input.read((char*) saved.data(), count * sizeof(double))) throw std::runtime_error("Truncated checkpoint " + name);
+            row = saved[0];
+            position = 1;
+            pending = true;
+        };
+        bool due() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - last).count() >= interval;
+        };
+        // True while the snapshot being resumed belongs to the current row
+        bool resuming() {
+            return pending && (long) saved[0] == row;
+        };
+        // The row and the values of a snapshot not resumed yet, false if there is none
+        bool snapshot(long& saved_row, std::vector<double>& values) {
+            if (!pending) return false;
+            saved_row = saved[0];
+            values.assign(saved.begin() + position, saved.end());
+            return true;
+        };
+        double get() {
+            if (position >= saved.size()) throw std::runtime_error("Checkpoint " + name + " does not match this run");
+            return saved[position++];
+        };
+        void get(Conditions& state) {
+            state.im = get();
+            state.am = get();
+            state.count = get();
+            state.mass = get();
+            state.agg.resize((std::size_t) get());
+            for (int i = 0; i < state.agg.size(); i++) state.agg[i] = get();
+        };
+        void get(Integrator& integrator) {
+            double trial_step = get();
+            long steps = get();
+            long rejected = get();
+            integrator.resume(trial_step, steps, rejected, get());
+        };
+        // Ends resuming; later rows start from scratch
+        void resumed() {
+            pending = false;
+            saved.clear();
+        };
+        void begin() {
+            values.assign(1, row);
+        };
+        void put(double value) {
+            values.push_back(value);
+        };
+        void put(Conditions& state) {
+            put(state.im);
+            put(state.am);
+            put(state.count);
+            put(state.mass);
+            put(state.agg.size());
+            values.insert(values.end(), state.agg.begin(), state.agg.end());
+        };
+        void put(Integrator& integrator) {
+            put(integrator.trial_step());
+            put(integrator.steps);
+            put(integrator.rejected);
+            put(integrator.calm_since());
+        };
+        void commit() {
+            std::string temporary = name + ".tmp";
+            std::ofstream output(temporary, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+            std::uint64_t count = values.size();
+            output.write(CHECKPOINT_MAGIC, 4);
+            output.write((const char*) &count, sizeof(count));
+            output.write((const char*) values.data(), count * sizeof(double));
+            output.close();
+            if (!output || std::rename(temporary.c_str(), name.c_str()) != 0) {
+                std::cerr << "Cannot write checkpoint " << name << std::endl;
+            }
+            last = std::chrono::steady_clock::now();
+        };
+    private:
+        std::string name;
+        double interval;
+        std::chrono::steady_clock::time_point last;
+        bool pending;
+        std::vector<double> saved;
+        std::size_t position;
+        std::vector<double> values;
+};
+
+// Streams sampled concentrations to a file; only the current state and the
+// integrator's ping-pong state are held, whatever the time length
+class Concentrations {
+    public:
+        Conditions initial;
+        Params params;
+        double time_length;
+        Integrator integrator;
+        int points; // evenly spaced samples, 0 writes every step
+        Checkpoint* checkpoint;
+        Concentrations(Conditions& initial, Params& params, double time_length, Integrator integrator, int points = DEFAULT_POINTS, Checkpoint* checkpoint = nullptr)
+            : initial(initial), params(params), time_length(time_length), integrator(integrator), points(points), checkpoint(checkpoint) {};
+        // Snapshots are taken right after a buffer is written out, together
+        // with the file length at that point
+        void print(std::string& file_name) {
+            std::ofstream output;
+            std::string buffer;
+            buffer.reserve(OUTPUT_BUFFER + bins.limit() * 16);
+            Conditions state(initial);
+            state.measure(params);
+            double time = 0;
+            int point = 1;
+            double written = 0;
+            if (checkpoint && checkpoint->resuming()) {
+                point = checkpoint->get();
+                time = checkpoint->get();
+                checkpoint->get(state);
+                checkpoint->get(integrator);
+                written = checkpoint->get();
+                checkpoint->resumed();
+                std::filesystem::resize_file(file_name, (std::uintmax_t) written);
+                output.open(file_name, std::ofstream::out | std::ofstream::app);
+            } else {
+                output.open(file_name, std::ofstream::out | std::ofstream::trunc);
+                append(buffer, time, state);
+            }
+            for (; time < time_length; point++) {
+                if (points > 0) integrator.advance(state, params, time, time_length * point / points);
+                else integrator.step(state, params, time, time_length);
+                if (integrator.diverged) throw std::runtime_error("Integration diverged before time " + std::to_string(time));
+                append(buffer, time, state);
+                if (buffer.size() >= OUTPUT_BUFFER) {
+                    output.write(buffer.data(), buffer.size());
+                    written += buffer.size();
+                    buffer.clear();
+                    if (checkpoint && checkpoint->due()) {
+                        output.flush();
+                        checkpoint->begin();
+                        checkpoint->put(point + 1);
+                        checkpoint->put(time);
+                        checkpoint->put(state);
+                        checkpoint->put(integrator);
+                        checkpoint->put(written);
+                        checkpoint->commit();
+                    }
+                }
+            }
+            output.write(buffer.data(), buffer.size());
+            output.close();
+        };
+        // The csv of print handed to sink in pieces of about OUTPUT_BUFFER
+        // bytes as it is produced; stops early once sink returns false
+        bool stream(const std::function<bool(std::string&)>& sink) {
+            std::string buffer;
+            buffer.reserve(OUTPUT_BUFFER + bins.limit() * 16);
+            Conditions state(initial);
+            state.measure(params);
+            double time = 0;
+            append(buffer, time, state);
+            for (int point = 1; time < time_length; point++) {
+                if (points > 0) integrator.advance(state, params, time, time_length * point / points);
+                else integrator.step(state, params, time, time_length);
+                if (integrator.diverged) throw std::runtime_error("Integration diverged before time " + std::to_string(time));
+                append(buffer, time, state);
+                if (buffer.size() >= OUTPUT_BUFFER) {
+                    if (!sink(buffer)) return false;
+                    buffer.clear();
+                }
+            }
+            return sink(buffer);
+        };
+        // Columnar binary output, widened whenever the chain outgrows its columns
+        void print_binary(std::string& file_name) {
+            if (points <= 0) throw std::runtime_error("Binary concentrations need --points above 0");
+            bool resume = checkpoint && checkpoint->resuming();
+            ColumnWriter output(file_name, make_header(CONC_FILE, points + 1, bins.limit() + 3, params, initial, integrator.step_size), initial, resume);
+            Conditions state(initial);
+            state.measure(params);
+            double time = 0;
+            int first = 0;
+            if (resume) {
+                first = checkpoint->get();
+                time = checkpoint->get();
+                checkpoint->get(state);
+                checkpoint->get(integrator);
+                checkpoint->resumed();
+            }
+            for (int point = first; point <= points; point++) {
+                if (point > 0) integrator.advance(state, params, time, time_length * point / points);
+                if (integrator.diverged) throw std::runtime_error("Integration diverged before time " + std::to_string(time));
+                output.set(0, point, time);
+                output.set(1, point, state.im);
+                output.set(2, point, state.am);
+                output.widen(state.agg.size() + 3);
+                for (int j = 0; j < state.agg.size(); j++) {
+                    if (state.agg[j] != 0) output.set(3 + j, point, state.agg[j]);
+                }
+                if (checkpoint && checkpoint->due()) {
+                    output.sync();
+                    checkpoint->begin();
+                    checkpoint->put(point + 1);
+                    checkpoint->put(time);
+                    checkpoint->put(state);
+                    checkpoint->put(integrator);
+                    checkpoint->commit();
+                }
+            }
+        };
+    private:
+        // One csv row, trailing empty aggregate sizes are left out
+        void append(std::string& buffer, double time, Conditions& state) {
+            char number[32];
+            int size = state.agg.size();
+            while (size > 1 && state.agg[size - 1] == 0) size--;
+            buffer.append(number, std::snprintf(number, sizeof(number), "%g,%g,%g", time, state.im, state.am));
+            for (int j = 0; j < size; j++) {
+                buffer.append(number, std::snprintf(number, sizeof(number), ",%g", (double) state.agg[j]));
+            }
+            buffer.push_back('\n');
+        };
+};
+
+class Masses {
+    public:
+        Column times;
+        Column masses;
+        double scale; // applied on read, so normalizing never touches mapped data
+        double settled; // time a generated run reached steady state, INFINITY if it did not
+        Masses()
+            : times(), masses(), scale(1), settled(INFINITY) {};
+        Masses(std::vector<double> times, std::vector<double> masses)
+            : times(), masses(), scale(1), settled(INFINITY)
+        {
+            for (int i = 0; i < times.size(); i++) {
+                this->times.push_back(times[i]);
+                this->masses.push_back(masses[i]);
+            }
+        };
+        Masses(Conditions initial, Params params, double time_length, Integrator integrator, int points = DEFAULT_POINTS, bool progress = true, Checkpoint* checkpoint = nullptr)
+            : times(), masses(), scale(1), settled(INFINITY)
+        {
+            double display_steps = 100;
+            progress = progress && logging(LogLevel::info);
+            double display_next = progress ? 0 : INFINITY;
+            if (progress) std::cout << "Generating Mass" << std::endl;
+            double time = 0;
+            int first = 1;
+            times.reserve(points + 1);
+            masses.reserve(points + 1);
+            if (checkpoint && checkpoint->resuming()) {
+                first = checkpoint->get();
+                time = checkpoint->get();
+                checkpoint->get(initial);
+                checkpoint->get(integrator);
+                for (int i = 0; i < first; i++) {
+                    times.push_back(checkpoint->get());
+                    masses.push_back(checkpoint->get());
+                }
+                checkpoint->resumed();
+            } else {
+                initial.measure(params);
+                masses.push_back(initial.mass);
+                times.push_back(time);
+            }
+            for (int point = first; point <= points; point++) {
+                integrator.advance(initial, params, time, time_length * point / points);
+                if (integrator.diverged) throw std::runtime_error("Integration diverged before time " + std::to_string(time));
+                masses.push_back(integrator.mass(initial, params));
+                times.push_back(time);
+                if (integrator.settled(initial, params, time, time_length)) {
+                    // the remaining samples keep the steady state value
+                    settled = time;
+                    double value = masses[point];
+                    for (point++; point <= points; point++) {
+                        masses.push_back(value);
+                        times.push_back(time_length * point / points);
+                    }
+                    break;
+                }
+                if (checkpoint && checkpoint->due()) {
+                    checkpoint->begin();
+                    checkpoint->put(point + 1);
+                    checkpoint->put(time);
+                    checkpoint->put(initial);
+                    checkpoint->put(integrator);
+                    for (int i = 0; i <= point; i++) {
+                        checkpoint->put(times[i]);
+                        checkpoint->put(masses[i]);
+                    }
+                    checkpoint->commit();
+                }
+                if (time > display_next) {
+                    std::cout << "\r" << "[" << std::string((int) (display_steps * time / time_length), (char)254u) << std::string(display_steps - (int) (display_steps * time / time_length), ' ') << "]";
+                    std::cout.flush();
+                    display_next += time_length / display_steps;
+                }
+            }
+        };
+        Masses(const Masses &orig)
+            : times(orig.times), masses(orig.masses), scale(orig.scale), settled(orig.settled) {};
+        Masses& operator=(const Masses&) = default;
+        // Views the columns of a binary masses file without copying them
+        Masses(std::shared_ptr<MappedFile> file)
+            : scale(1), settled(INFINITY)
+        {
+            BinaryHeader header;
+            std::memcpy(&header, file->data(), sizeof(header));
+            std::size_t offset = sizeof(header) + header.initial_count * sizeof(double);
+            if (header.kind != MASS_FILE || header.columns != 2 || file->size() < offset + 2 * header.rows * sizeof(double)) {
+                throw std::runtime_error("Not a binary masses file");
+            }
+            const double* columns = (const double*) (file->data() + offset);
+            times = Column(file, columns, header.rows);
+            masses = Column(file, columns + header.rows, header.rows);
+        };
+        double mass(int i) {
+            return masses[i] * scale;
+        };
+        void print(std::string file_name) {
+            std::ofstream output;
+            output.open(file_name, std::ofstream::out | std::ofstream::trunc);
+            write(output);
+            output.close();
+        };
+        // "time,mass" rows
+        void write(std::ostream& output) {
+            for (int i = 0; i < times.size(); i++) {
+                output << times[i] << ',' << mass(i) << '\n';
+            }
+        };
+        void print_binary(std::string file_name, Params& params, Conditions& initial, double step_size) {
+            BinaryHeader header = make_header(MASS_FILE, times.size(), 2, params, initial, step_size);
+            std::ofstream output;
+            output.open(file_name, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+            output.write((const char*) &header, sizeof(header));
+            output.write((const char*) &initial.im, sizeof(double));
+            output.write((const char*) &initial.am, sizeof(double));
+            std::vector<double> agg(initial.agg.begin(), initial.agg.end()); // files stay double whatever the chain type
+            output.write((const char*) agg.data(), agg.size() * sizeof(double));
+            for (int column = 0; column < 2; column++) {
+                for (int i = 0; i < times.size(); i++) {
+                    double value = column == 0 ? times[i] : mass(i);
+                    output.write((const char*) &value, sizeof(double));
+                }
+            }
+            output.close();
+        };
+        double get(double time) {
+            int L = 0;
+            int R = times.size() - 1;
+            int m;
+            while (L <= R) {
+                m = (L + R) / 2;
+                if (times[m] < time) {
+                    L = m + 1;
+                } else if (times[m] > time) {
+                    R = m - 1;
+                } else return mass(m);
+            }
+            if (R >= times.size() || L >= times.size()) return mass(times.size() - 1);
+            if (L < 0 || R < 0) return mass(0);
+            return (mass(R) + mass(L)) / 2;
+        }
+        void normalize(double time) {
+            scale /= get(time);
+        }
+};
+
+// Parses numbers in place out of a MappedFile with std::from_chars; errors
+// name the file, line and column
+class Reader {
+    public:
+        Reader(std::shared_ptr<MappedFile> file, const std::string& name)
+            : file(file), name(name), position(file->data()), end(file->data() + file->size()), line(1), line_start(position) {};
+        // Skips whitespace and blank lines, true once nothing else is left
+        bool done() {
+            while (position < end && std::isspace((unsigned char) *position)) {
+                if (*position == '\n') {
+                    line++;
+                    line_start = position + 1;
+                }
+                position++;
+            }
+            return position == end;
+        };
+        bool peek(char c) {
+            skip_spaces();
+            return position < end && *position == c;
+        };
+        void expect(char c) {
+            if (!peek(c)) fail(std::string("expected '") + c + "'");
+            position++;
+        };
+        bool end_of_line() {
+            skip_spaces();
+            return position == end || *position == '\n' || *position == '\r';
+        };
+        double number() {
+            skip_spaces();
+            if (position < end && *position == '+') position++;
+            double value;
+            std::from_chars_result result = std::from_chars(position, end, value);
+            if (result.ec != std::errc()) fail("expected a number");
+            position = result.ptr;
+            return value;
+        };
+        [[noreturn]] void fail(const std::string& what) {
+            throw std::runtime_error(name + ":" + std::to_string(line) + ":" + std::to_string(position - line_start + 1) + ": " + what);
+        };
+    private:
+        std::shared_ptr<MappedFile> file;
+        std::string name;
+        const char* position;
+        const char* end;
+        int line;
+        const char* line_start;
+        void skip_spaces() {
+            while (position < end && (*position == ' ' || *position == '\t')) position++;
+        };
+};
+
+// One "n,r,forward...,backward..." row per line
+std::vector<Params> read_params(const std::string& file_name) {
+    Reader reader(std::make_shared<MappedFile>(file_name), file_name);
+    std::vector<Params> params;
+    while (!reader.done()) {
+        Params row;
+        row.n = reader.number();
+        reader.expect(',');
+        row.r = reader.number();
+        for (int i = 0; i < 2 * RATE_CONSTANTS; i++) {
+            reader.expect(',');
+            (i < RATE_CONSTANTS ? row.forward[i] : row.backward[i - RATE_CONSTANTS]) = reader.number();
+        }
+        if (!reader.end_of_line()) reader.fail("expected end of line");
+        params.push_back(row);
+    }
+    return params;
+}
+
+// One "im,am,aggregates..." row per line
+std::vector<Conditions> read_conditions(const std::string& file_name) {
+    Reader reader(std::make_shared<MappedFile>(file_name), file_name);
+    std::vector<Conditions> conditions;
+    while (!reader.done()) {
+        Conditions row;
+        row.im = reader.number();
+        reader.expect(',');
+        row.am = reader.number();
+        while (!reader.end_of_line()) {
+            reader.expect(',');
+            row.agg.push_back(reader.number());
+        }
+        if (row.agg.empty()) reader.fail("expected aggregate concentrations");
+        conditions.push_back(row);
+    }
+    return conditions;
+}
+
+// Just enough JSON for server requests: objects, arrays, numbers, strings
+// without \u escapes, true, false and null
+class Json {
+    public:
+        enum Type { null, boolean, number, string, array, object };
+        Type type;
+        double value; // number, or 1 and 0 for true and false
+        std::string text;
+        std::vector<Json> items;
+        std::vector<std::pair<std::string, Json>> members;
+        Json()
+            : type(null), value(0) {};
+        static Json parse(const std::string& source) {
+            const char* position = source.data();
+            const char* end = position + source.size();
+            Json result = parse_value(position, end, 0);
+            skip(position, end);
+            if (position != end) throw std::runtime_error("unexpected text after the JSON value");
+            return result;
+        };
+        // Member of an object, nullptr when it is missing
+        const Json* get(const std::string& key) const {
+            for (int i = 0; i < members.size(); i++) {
+                if (members[i].first == key) return &members[i].second;
+            }
+            return nullptr;
+        };
+        double number_at(const std::string& key) const {
+            const Json* member = get(key);
+            if (!member || member->type != number) throw std::runtime_error("expected a number for " + key);
+            return member->value;
+        };
+        std::string string_at(const std::string& key) const {
+            const Json* member = get(key);
+            if (!member || member->type != string) throw std::runtime_error("expected a string for " + key);
+            return member->text;
+        };
+        // Numbers of the array member key
+        std::vector<double> numbers_at(const std::string& key) const {
+            const Json* member = get(key);
+            if (!member || member->type != array) throw std::runtime_error("expected an array for " + key);
+            std::vector<double> values;
+            for (int i = 0; i < member->items.size(); i++) {
+                if (member->items[i].type != number) throw std::runtime_error("expected numbers in " + key);
+                values.push_back(member->items[i].value);
+            }
+            return values;
+        };
+    private:
+        static const int DEPTH_LIMIT = 64;
+        static void skip(const char*& position, const char* end) {
+            while (position < end && std::isspace((unsigned char) *position)) position++;
+        };
+        static bool literal(const char*& position, const char* end, const char* word) {
+            int length = std::strlen(word);
+            if (end - position < length || std::strncmp(position, word, length) != 0) return false;
+            position += length;
+            return true;
+        };
+        static std::string parse_string(const char*& position, const char* end) {
+            std::string text;
+            position++;
+            while (position < end && *position != '"') {
+                char c = *position++;
+                if (c == '\\' && position < end) {
+                    c = *position++;
+                    if (c == 'n') c = '\n';
+                    else if (c == 't') c = '\t';
+                    else if (c == 'r') c = '\r';
+                    else if (c == 'b') c = '\b';
+                    else if (c == 'f') c = '\f';
+                    else if (c == 'u') throw std::runtime_error("\\u escapes are not supported");
+                }
+                text.push_back(c);
+            }
+            if (position == end) throw std::runtime_error("unterminated JSON string");
+            position++;
+            return text;
+        };
+        static Json parse_value(const char*& position, const char* end, int depth) {
+            if (depth > DEPTH_LIMIT) throw std::runtime_error("JSON nested too deeply");
+            skip(position, end);
+            if (position == end) throw std::runtime_error("expected a JSON value");
+            Json result;
+            if (*position == '{' || *position == '[') {
+                bool is_object = *position == '{';
+                char close = is_object ? '}' : ']';
+                result.type = is_object ? object : array;
+                position++;
+                skip(position, end);
+                if (position < end && *position == close) {
+                    position++;
+                    return result;
+                }
+                while (true) {
+                    if (is_object) {
+                        skip(position, end);
+                        if (position == end || *position != '"') throw std::runtime_error("expected a JSON key");
+                        std::string key = parse_string(position, end);
+                        skip(position, end);
+                        if (position == end || *position != ':') throw std::runtime_error("expected ':' in JSON object");
+                        position++;
+                        result.members.push_back(std::make_pair(key, parse_value(position, end, depth + 1)));
+                    } else {
+                        result.items.push_back(parse_value(position, end, depth + 1));
+                    }
+                    skip(position, end);
+                    if (position < end && *position == ',') {
+                        position++;
+                        continue;
+                    }
+                    if (position < end && *position == close) {
+                        position++;
+                        return result;
+                    }
+                    throw std::runtime_error(std::string("expected ',' or '") + close + "' in JSON");
+                }
+            }
+            if (*position == '"') {
+                result.type = string;
+                result.text = parse_string(position, end);
+            } else if (literal(position, end, "true")) {
+                result.type = boolean;
+                result.value = 1;
+            } else if (literal(position, end, "false")) {
+                result.type = boolean;
+            } else if (literal(position, end, "null")) {
+                result.type = null;
+            } else {
+                std::from_chars_result parsed = std::from_chars(position, end, result.value);
+                if (parsed.ec != std::errc()) throw std::runtime_error("expected a JSON value");
+                result.type = number;
+                position = parsed.ptr;
+            }
+            return result;
+        };
+};
+
+// "time,mass" rows; a '>' starts the next dataset
+std::vector<Masses> read_masses(std::shared_ptr<MappedFile> file, const std::string& file_name) {
+    Reader reader(file, file_name);
+    std::vector<Masses> datasets;
+    while (!reader.done()) {
+        if (reader.peek('>')) reader.expect('>');
+        Masses data;
+        while (!reader.done() && !reader.peek('>')) {
+            data.times.push_back(reader.number());
+            reader.expect(',');
+            data.masses.push_back(reader.number());
+            if (!reader.end_of_line()) reader.fail("expected end of line");
+        }
+        if (data.times.size() > 0) datasets.push_back(data);
+    }
+    return datasets;
+}
+
+static const int LANES = 8;
+
+// One value per ensemble lane. GCC and Clang map the arithmetic straight onto
+// vector registers; the struct keeps other compilers building.
+#if defined(__GNUC__)
+typedef double Lanes __attribute__((vector_size(LANES * sizeof(double)), aligned(LANES * sizeof(double)), may_alias));
+#else
+struct Lanes {
+    double v[LANES];
+    double& operator[](int k) { return v[k]; }
+    double operator[](int k) const { return v[k]; }
+};
+static Lanes lanes_op(Lanes a, Lanes b, char op) {
+    for (int k = 0; k < LANES; k++) a[k] = op == '+' ? a[k] + b[k] : op == '-' ? a[k] - b[k] : op == '*' ? a[k] * b[k] : a[k] / b[k];
+    return a;
+}
+static Lanes lanes_fill(double x) { Lanes a; for (int k = 0; k < LANES; k++) a[k] = x; return a; }
+static Lanes operator+(Lanes a, Lanes b) { return lanes_op(a, b, '+'); }
+static Lanes operator-(Lanes a, Lanes b) { return lanes_op(a, b, '-'); }
+static Lanes operator*(Lanes a, Lanes b) { return lanes_op(a, b, '*'); }
+static Lanes operator/(Lanes a, Lanes b) { return lanes_op(a, b, '/'); }
+static Lanes operator+(double a, Lanes b) { return lanes_fill(a) + b; }
+static Lanes operator-(double a, Lanes b) { return lanes_fill(a) - b; }
+static Lanes operator*(double a, Lanes b) { return lanes_fill(a) * b; }
+static Lanes operator+(Lanes a, double b) { return a + lanes_fill(b); }
+static Lanes operator-(Lanes a) { return 0.0 - a; }
+static Lanes& operator+=(Lanes& a, Lanes b) { return a = a + b; }
+static Lanes& operator-=(Lanes& a, Lanes b) { return a = a - b; }
+#endif
+
+// std::vector drops the alignment attribute of Lanes, so lane arrays are
+// carved out of a double buffer at a LANES * sizeof(double) boundary
+class LaneArray {
+    public:
+        LaneArray(int size = 0)
+            : count(0) { resize(size); };
+        // Keeps the entries both sizes share, new ones are zero
+        void resize(int size) {
+            if (size == count && !storage.empty()) return;
+            std::vector<double> kept(std::min(count, size) * LANES);
+            if (!kept.empty()) std::memcpy(kept.data(), data(), kept.size() * sizeof(double));
+            count = size;
+            storage.assign((size + 1) * LANES, 0);
+            if (!kept.empty()) std::memcpy(data(), kept.data(), kept.size() * sizeof(double));
+        };
+        int size() const {
+            return count;
+        };
+        Lanes* data() {
+            std::uintptr_t address = (std::uintptr_t) storage.data();
+            std::uintptr_t align = sizeof(Lanes);
+            return (Lanes*) ((address + align - 1) / align * align);
+        };
+        Lanes& operator[](int i) {
+            return data()[i];
+        };
+        void swap(LaneArray& other) {
+            storage.swap(other.storage);
+            std::swap(count, other.count);
+        };
+    private:
+        int count;
+        std::vector<double> storage;
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LANE_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LANE_CLONES
+#endif
+
+// LANES systems advanced in lock-step with one shared step size. Entry j of y
+// holds component j of every lane (0 is im, 1 is am, then the aggregate sizes),
+// so each sweep over the chain updates all lanes at once. Lanes past count
+// repeat the first system and are ignored. The chain grows like the scalar
+// one: by one size per euler step like become_next, and for ros2 by
+// ARRAY_LIMIT sizes once the last size of some lane holds more than the
+// tolerances allow, flux past the last size leaving it as in rates().
+class Ensemble {
+    public:
+        int count;
+        int size;
+        int active; // sizes in use, the rest are zero in every lane
+        LaneArray y;
+        Ensemble(std::vector<Params>& params, std::vector<Conditions>& initials, int first, int count)
+            : count(count), size(ARRAY_LIMIT), active(1), y()
+        {
+            for (int k = 0; k < count; k++) size = std::max(size, (int) initials[(first + k) % initials.size()].agg.size());
+            y.resize(size + 2);
+            for (int k = 0; k < LANES; k++) {
+                int row = first + (k < count ? k : 0);
+                Params& p = params[row];
+                Conditions& c = initials[row % initials.size()];
+                n[k] = p.n;
+                r[k] = p.r;
+                ka[k] = p.forward[0];
+                kn[k] = p.forward[1];
+                ke[k] = p.forward[2];
+                kam[k] = p.backward[0];
+                knm[k] = p.backward[1];
+                kem[k] = p.backward[2];
+                y[0][k] = c.im;
+                y[1][k] = c.am;
+                for (int i = 0; i < std::min((int) c.agg.size(), size); i++) y[i + 2][k] = c.agg[i];
+                active = std::max(active, std::min((int) c.agg.size(), size));
+            }
+        };
+        LANE_CLONES void mass(double* out) {
+            Lanes total = Lanes{};
+            for (int i = 0; i < active; i++) total += (n + (double) i) * y[i + 2];
+            for (int k = 0; k < LANES; k++) out[k] = total[k];
+        };
+        // Integrates every lane to target with euler or ros2 from the integrator
+        // settings; ros2 marks the integrator diverged like Integrator::step
+        void advance(Integrator& integrator, double& time, double target) {
+            k0.resize(y.size());
+            k1.resize(y.size());
+            tmp.resize(y.size());
+            next.resize(y.size());
+            if (h <= 0) h = integrator.step_size;
+            while (target - time > 1e-9 * integrator.step_size) {
+                if (integrator.method == Method::euler) {
+                    euler(integrator.step_size);
+                    time += integrator.step_size;
+                    integrator.steps++;
+                    continue;
+                }
+                if (integrator.diverged || integrator.steps >= STEP_LIMIT) {
+                    integrator.diverged = true;
+                    time = target;
+                    return;
+                }
+                static const double gamma = 1 + 1 / std::sqrt(2.0);
+                if (tail_heavy(integrator.rtol, integrator.atol)) grow();
+                active = size;
+                bool clipped = h >= target - time;
+                double dt = clipped ? target - time : h;
+                double err = ros2(dt, gamma * dt, integrator.rtol, integrator.atol);
+                if (!std::isfinite(err) || !finite(next)) err = INFINITY;
+                double factor = err == 0 ? 5 : std::min(5.0, std::max(0.2, 0.9 / std::sqrt(err)));
+                double h_min = 1e-12 * (time + integrator.step_size);
+                if (err <= 1 || (dt <= h_min && err < INFINITY)) {
+                    y.swap(next);
+                    time = clipped ? target : time + dt;
+                    integrator.steps++;
+                    h = std::max(clipped ? std::max(h, dt * factor) : dt * factor, h_min);
+                } else {
+                    if (dt <= h_min) integrator.diverged = true;
+                    integrator.rejected++;
+                    h = std::max(dt * factor, h_min);
+                }
+            }
+        };
+    private:
+        Lanes n, r, ka, kn, ke, kam, knm, kem;
+        double h = 0;
+        LaneArray k0, k1, tmp, next;
+        // Factorization of (I - c * J) in every lane, laid out as in Factorization
+        LaneArray pivot, ratio, column, row;
+        Lanes lower, upper, m_ii, m_ia, m_ai, schur;
+        // im and am of every lane, where a non-finite aggregate shows up a step later
+        static bool finite(LaneArray& state) {
+            for (int k = 0; k < LANES; k++) {
+                if (!std::isfinite(state[0][k]) || !std::isfinite(state[1][k])) return false;
+            }
+            return true;
+        };
+        // Derivative over the first len sizes; below size the last flux feeds size len
+        LANE_CLONES void rates(const Lanes* A, Lanes* dA, int len) {
+            Lanes am = A[1];
+            Lanes power;
+            for (int k = 0; k < LANES; k++) power[k] = nucleation_power(am[k], r[k]);
+            Lanes activation = A[0] * ka - am * kam;
+            Lanes nucleation = power * kn - A[2] * knm;
+            Lanes ke_am = am * ke;
+            Lanes flux_in = nucleation;
+            Lanes elongation = Lanes{};
+            for (int i = 0; i < len - 1; i++) {
+                Lanes flux = ke_am * A[i + 2] - kem * A[i + 3];
+                dA[i + 2] = flux_in - flux;
+                flux_in = flux;
+                elongation += flux;
+            }
+            Lanes flux = ke_am * A[len + 1];
+            dA[len + 1] = flux_in - flux;
+            elongation += flux;
+            if (len < size) dA[len + 2] = flux;
+            dA[0] = -activation;
+            dA[1] = activation - n * nucleation - elongation;
+        };
+        // ARRAY_LIMIT more sizes, zero in every lane
+        void grow() {
+            size += ARRAY_LIMIT;
+            y.resize(size + 2);
+            k0.resize(y.size());
+            k1.resize(y.size());
+            tmp.resize(y.size());
+            next.resize(y.size());
+        };
+        // The last size of some lane carries more mass than the tolerances allow
+        bool tail_heavy(double rtol, double atol) {
+            double total[LANES];
+            mass(total);
+            for (int k = 0; k < LANES; k++) {
+                if (std::fabs(y[size + 1][k]) * (n[k] + size - 1) > atol + rtol * std::fabs(total[k])) return true;
+            }
+            return false;
+        };
+        LANE_CLONES void euler(double dt) {
+            if (active == size) grow();
+            int len = active + 1;
+            rates(y.data(), k0.data(), active);
+            if (active < size) y[active + 2] = Lanes{};
+            for (int j = 0; j < len + 2; j++) y[j] += dt * k0[j];
+            active = len;
+            while (active > 2) {
+                bool empty = true;
+                for (int k = 0; k < LANES; k++) empty = empty && y[active + 1][k] == 0;
+                if (!empty) break;
+                active--;
+            }
+        };
+        LANE_CLONES double ros2(double dt, double c, double rtol, double atol) {
+            factor(c);
+            rates(y.data(), k0.data(), size);
+            solve(k0.data());
+            for (int j = 0; j < y.size(); j++) tmp[j] = y[j] + dt * k0[j];
+            rates(tmp.data(), k1.data(), size);
+            for (int j = 0; j < y.size(); j++) k1[j] -= 2.0 * k0[j];
+            solve(k1.data());
+            double err = 0;
+            for (int j = 0; j < y.size(); j++) {
+                next[j] = y[j] + dt * (1.5 * k0[j] + 0.5 * k1[j]);
+                Lanes e = 0.5 * dt * (k0[j] + k1[j]);
+                for (int k = 0; k < LANES; k++) {
+                    double scale = atol + rtol * std::max(std::fabs(y[j][k]), std::fabs(next[j][k]));
+                    err = std::max(err, std::fabs(e[k]) / scale);
+                }
+            }
+            return err;
+        };
+        LANE_CLONES void factor(double c) {
+            pivot.resize(size);
+            ratio.resize(size);
+            column.resize(size);
+            row.resize(size);
+            const Lanes* a = y.data() + 2;
+            Lanes am = y[1];
+            Lanes ke_am = ke * am;
+            Lanes dnuc;
+            for (int k = 0; k < LANES; k++) {
+                dnuc[k] = am[k] > 0 ? r[k] * nucleation_power(am[k], r[k] - 1) : (r[k] == 1 ? 1 : 0);
+            }
+            Lanes total = Lanes{};
+            lower = -c * ke_am;
+            upper = -c * kem;
+            for (int i = 0; i < size; i++) {
+                total += a[i];
+                Lanes diag = 1 + c * (ke_am + (i == 0 ? knm : kem));
+                pivot[i] = i == 0 ? diag : diag - lower * ratio[i - 1];
+                ratio[i] = upper / pivot[i];
+                if (i == 0) {
+                    column[i] = -c * (kn * dnuc - ke * a[i]);
+                    row[i] = -c * (n * knm - ke_am);
+                } else {
+                    column[i] = -c * ke * (a[i - 1] - a[i]);
+                    row[i] = -c * (kem - ke_am);
+                }
+            }
+            tridiagonal(column.data());
+            m_ii = 1 + c * ka;
+            m_ia = -c * kam;
+            m_ai = -c * ka;
+            schur = 1 + c * (kam + n * kn * dnuc + ke * total);
+            for (int i = 0; i < size; i++) schur -= row[i] * column[i];
+        };
+        LANE_CLONES void tridiagonal(Lanes* b) {
+            b[0] = b[0] / pivot[0];
+            for (int i = 1; i < size; i++) b[i] = (b[i] - lower * b[i - 1]) / pivot[i];
+            for (int i = size - 2; i >= 0; i--) b[i] -= ratio[i] * b[i + 1];
+        };
+        // Overwrites B with the solution of (I - c * J) X = B in every lane
+        LANE_CLONES void solve(Lanes* B) {
+            Lanes* b = B + 2;
+            tridiagonal(b);
+            Lanes am_rhs = B[1];
+            for (int i = 0; i < size; i++) am_rhs -= row[i] * b[i];
+            Lanes det = m_ii * schur - m_ia * m_ai;
+            Lanes x_im = (B[0] * schur - m_ia * am_rhs) / det;
+            Lanes x_am = (m_ii * am_rhs - m_ai * B[0]) / det;
+            B[0] = x_im;
+            B[1] = x_am;
+            for (int i = 0; i < size; i++) b[i] -= x_am * column[i];
+        };
+};
+
+// Mass curves for every row of params, LANES rows per Ensemble and the
+// ensembles spread over the pool; rows cycle through the initial conditions
+void generate_ensemble(std::vector<Params>& params, std::vector<Conditions>& conditions, double time_length, Integrator& integrator, int points, ThreadPool& pool, std::string output, bool binary) {
+    std::vector<std::function<void()>> tasks;
+    for (int first = 0; first < params.size(); first += LANES) {
+        tasks.push_back([&, first]() {
+            int count = std::min(LANES, (int) params.size() - first);
+            Ensemble ensemble(params, conditions, first, count);
+            Integrator lane_integrator(integrator);
+            std::vector<Masses> curves(count);
+            double mass[LANES];
+            double time = 0;
+            for (int point = 0; point <= points; point++) {
+                if (point > 0) ensemble.advance(lane_integrator, time, time_length * point / points);
+                if (lane_integrator.diverged) throw std::runtime_error("Rows " + std::to_string(first) + " to " + std::to_string(first + count - 1) + " diverged");
+                ensemble.mass(mass);
+                for (int k = 0; k < count; k++) {
+                    curves[k].times.push_back(time);
+                    curves[k].masses.push_back(mass[k]);
+                }
+            }
+            for (int k = 0; k < count; k++) {
+                std::string file_name = std::to_string(first + k) + output;
+                if (binary) curves[k].print_binary(file_name, params[first + k], conditions[(first + k) % conditions.size()], integrator.step_size);
+                else curves[k].print(file_name);
+            }
+        });
+    }
+    pool.run(tasks);
+}
+
+double MSE(std::vector<Masses>& A, std::vector<Masses>& B) {
+    int counter = 0;
+    double error = 0;
+    for (int i = 0; i < A.size(); i++) {
+        counter += A[i].times.size();
+        for (int j = 0; j < A[i].times.size(); j++) {
+            error += std::pow(B[i].get(A[i].times[j]) - A[i].mass(j), 2);
+        }
+    }
+    return error / counter;
+}
+
+// Errors of already simulated parameter vectors, keyed by their exact bits
+// and a hash of everything else the error depends on. With a file name the
+// entries are loaded at start and appended as they are computed, so re-runs
+// and restarted fits skip simulations done before.
+static const char CACHE_MAGIC[4] = {'K', 'M', 'C', '1'};
+
+class EvalCache {
+    public:
+        typedef std::array<uint64_t, 9> Key; // context, n, r, forward, backward
+        long hits;
+        long misses;
+        EvalCache(const char* file_name = nullptr)
+            : hits(0), misses(0), output(nullptr)
+        {
+            if (!file_name) return;
+            std::ifstream input(file_name, std::ifstream::in | std::ifstream::binary);
+            char magic[4];
+            bool existing = input.read(magic, 4) && std::memcmp(magic, CACHE_MAGIC, 4) == 0;
+            Record record;
+            while (existing && input.read((char*) &record, sizeof(Record))) {
+                entries[record.key] = record.error;
+            }
+            input.close();
+            output = std::fopen(file_name, existing ? "ab" : "wb");
+            if (!output) throw std::runtime_error(std::string("Cannot open cache ") + file_name);
+            if (!existing) std::fwrite(CACHE_MAGIC, 1, 4, output);
+            std::fflush(output);
+        };
+        ~EvalCache() {
+            if (output) std::fclose(output);
+        };
+        EvalCache(const EvalCache&) = delete;
+        EvalCache& operator=(const EvalCache&) = delete;
+        // FNV-1a over the bytes of value
+        static uint64_t mix(uint64_t hash, double value) {
+            unsigned char bytes[8];
+            std::memcpy(bytes, &value, 8);
+            for (int i = 0; i < 8; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+            return hash;
+        };
+        // Initial conditions, normalized data and integrator settings of a fit
+        static uint64_t context(std::vector<Conditions>& conditions, std::vector<Masses>& real_data, Integrator& integrator) {
+            // the chain precision changes every result, so float and double builds never share entries
+            uint64_t hash = mix(14695981039346656037ull, (double) sizeof(real));
+            for (int i = 0; i < conditions.size(); i++) {
+                hash = mix(hash, conditions[i].im);
+                hash = mix(hash, conditions[i].am);
+                for (int j = 0; j < conditions[i].agg.size(); j++) hash = mix(hash, conditions[i].agg[j]);
+                hash = mix(hash, -1.0);
+            }
+            for (int i = 0; i < real_data.size(); i++) {
+                for (int j = 0; j < real_data[i].times.size(); j++) {
+                    hash = mix(hash, real_data[i].times[j]);
+                    hash = mix(hash, real_data[i].mass(j));
+                }
+                hash = mix(hash, -1.0);
+            }
+            hash = mix(hash, integrator.step_size);
+            hash = mix(hash, (double) integrator.method);
+            if (integrator.method != Method::euler) {
+                hash = mix(hash, integrator.rtol);
+                hash = mix(hash, integrator.atol);
+            }
+            for (int i = 0; i < bins.count(); i++) hash = mix(hash, bins.sizes[i]);
+            if (integrator.drift > 0) hash = mix(hash, integrator.drift);
+            if (integrator.steady > 0) {
+                hash = mix(hash, integrator.steady);
+                hash = mix(hash, integrator.window);
+            }
+            return mix(hash, integrator.aligned ? -1.0 : (double) DEFAULT_POINTS);
+        };
+        static Key key(uint64_t context, Params& params) {
+            Key key;
+            key[0] = context;
+            std::memcpy(&key[1], &params.n, 8);
+            std::memcpy(&key[2], &params.r, 8);
+            for (int i = 0; i < RATE_CONSTANTS; i++) {
+                std::memcpy(&key[3 + i], &params.forward[i], 8);
+                std::memcpy(&key[3 + RATE_CONSTANTS + i], &params.backward[i], 8);
+            }
+            return key;
+        };
+        bool find(const Key& key, double& error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = entries.find(key);
+            if (found == entries.end()) {
+                misses++;
+                return false;
+            }
+            hits++;
+            error = found->second;
+            return true;
+        };
+        void insert(const Key& key, double error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!entries.emplace(key, error).second || !output) return;
+            Record record = {key, error};
+            std::fwrite(&record, sizeof(Record), 1, output);
+            std::fflush(output);
+        };
+    private:
+        struct Record {
+            Key key;
+            double error;
+        };
+        struct KeyHash {
+            std::size_t operator()(const Key& key) const {
+                uint64_t hash = 14695981039346656037ull;
+                for (int i = 0; i < key.size(); i++) hash = (hash ^ key[i]) * 1099511628211ull;
+                return hash;
+            };
+        };
+        std::unordered_map<Key, double, KeyHash> entries;
+        std::mutex mutex;
+        FILE* output;
+};
+
+// Follows each condition's sampling exactly as Masses(...) would, resolving
+// every data point as soon as the samples around its time exist, or with an
+// aligned integrator lands on every data time and takes the model there. For a
+// dataset the normalization 1 / N is only known at the end, but whatever it
+// turns out to be, sum (d - m / N)^2 over the points so far is at least
+// min over s of sum (d - s m)^2 = sum d^2 - (sum d m)^2 / sum m^2. These
+// bounds only grow, so once their total exceeds the threshold every run
+// stops and the candidate is known to lose.
+class BoundedError {
+    public:
+        BoundedError(std::vector<Masses>& real_data, double threshold)
+            : real_data(real_data), threshold(threshold), bounds(new std::atomic<double>[real_data.size()]),
+              lower(real_data.size()), upper(real_data.size()), aborted(false), count(0), slack(0)
+        {
+            for (int i = 0; i < real_data.size(); i++) {
+                bounds[i] = 0;
+                count += real_data[i].times.size();
+                for (int j = 0; j < real_data[i].times.size(); j++) slack += real_data[i].mass(j) * real_data[i].mass(j);
+            }
+            slack *= 1e-9; // rounding in the bound must never reject the true error
+        };
+        // Streaming needs the data times in order
+        static bool applies(std::vector<Masses>& real_data) {
+            for (int i = 0; i < real_data.size(); i++) {
+                for (int j = 1; j < real_data[i].times.size(); j++) {
+                    if (!(real_data[i].times[j - 1] < real_data[i].times[j])) return false;
+                }
+            }
+            return true;
+        };
+        void follow(int i, Conditions state, Params& params, Integrator integrator) {
+            Masses& data = real_data[i];
+            int total = data.times.size();
+            double end = data.times[total - 1];
+            std::vector<double>& below = lower[i];
+            std::vector<double>& above = upper[i];
+            below.resize(total);
+            above.resize(total);
+            double dd = 0, dm = 0, mm = 0;
+            int j = 0;
+            bool diverged = false; // the final error is then inf or nan, never accepted
+            double time = 0;
+            integrator.watch(&aborted); // a sibling proving the bound stops this run mid-sample too
+            state.measure(params);
+            double previous = state.mass;
+            auto resolve = [&](double low, double high) {
+                below[j] = low;
+                above[j] = high;
+                double d = data.mass(j);
+                double m = (low + high) / 2;
+                dd += d * d;
+                dm += d * m;
+                mm += m * m;
+                if (!std::isfinite(m)) diverged = true;
+                j++;
+            };
+            while (j < total && data.times[j] <= time) resolve(previous, previous);
+            int points = integrator.aligned ? total : DEFAULT_POINTS;
+            for (int point = 1; point <= points && j < total; point++) {
+                integrator.advance(state, params, time, integrator.aligned ? data.times[j] : end * point / DEFAULT_POINTS);
+                if (aborted) return;
+                if (integrator.diverged) {
+                    // rejected whatever the threshold, the bound is then infinite
+                    bounds[i] = INFINITY;
+                    aborted = true;
+                    return;
+                }
+                double current = integrator.mass(state, params);
+                if (integrator.aligned) resolve(current, current);
+                while (j < total && data.times[j] <= time) {
+                    if (data.times[j] == time) resolve(current, current);
+                    else resolve(previous, current);
+                }
+                previous = current;
+                bounds[i] = diverged ? INFINITY : mm > 0 ? std::max(0.0, dd - dm * dm / mm) : dd;
+                if (aborted) return;
+                if (bound() > threshold) {
+                    aborted = true;
+                    return;
+                }
+                if (integrator.settled(state, params, time, end)) break;
+            }
+            while (j < total) resolve(previous, previous);
+        };
+        bool rejected() {
+            return aborted;
+        };
+        double bound() {
+            double sum = 0;
+            for (int i = 0; i < real_data.size(); i++) sum += bounds[i];
+            return (sum - slack) / count;
+        };
+        // Same terms in the same order as MSE over normalized Masses
+        double error() {
+            double error = 0;
+            for (int i = 0; i < real_data.size(); i++) {
+                int last = real_data[i].times.size() - 1;
+                double scale = 1 / ((lower[i][last] + upper[i][last]) / 2);
+                for (int j = 0; j <= last; j++) {
+                    error += std::pow((lower[i][j] * scale + upper[i][j] * scale) / 2 - real_data[i].mass(j), 2);
+                }
+            }
+            return error / count;
+        };
+    private:
+        std::vector<Masses>& real_data;
+        double threshold;
+        std::unique_ptr<std::atomic<double>[]> bounds;
+        std::vector<std::vector<double>> lower; // raw model mass at the samples either side of each data time
+        std::vector<std::vector<double>> upper;
+        std::atomic<bool> aborted;
+        int count;
+        double slack;
+};
+
+// Each condition is integrated as its own task, the error is summed afterwards
+// in condition order so the result does not depend on the thread count.
+// Only errors below threshold matter to the caller: a candidate proven to be
+// above it is abandoned early and the (larger) bound is returned instead.
+double calc_error(Params& params, std::vector<Conditions>& conditions, std::vector<Masses>& real_data, Integrator& integrator, ThreadPool& pool, EvalCache* cache = nullptr, uint64_t context = 0, double threshold = INFINITY) {
+    double error;
+    EvalCache::Key key;
+    if (metrics.enabled) metrics.evaluations++;
+    if (cache) {
+        key = EvalCache::key(context, params);
+        if (cache->find(key, error)) {
+            if (metrics.enabled) metrics.cached++;
+            return error;
+        }
+    }
+    if (params.is_positive() && (threshold < INFINITY || integrator.aligned) && BoundedError::applies(real_data)) {
+        BoundedError bounded(real_data, threshold);
+        std::vector<std::function<void()>> tasks;
+        for (int i = 0; i < conditions.size(); i++) {
+            tasks.push_back([&, i]() {
+                bounded.follow(i, conditions[i], params, integrator);
+            });
+        }
+        pool.run(tasks);
+        if (bounded.rejected()) {
+            if (metrics.enabled) metrics.aborted++;
+            return bounded.bound();
+        }
+        error = bounded.error();
+    } else if (params.is_positive()) {
+        std::vector<Masses> model(conditions.size());
+        std::atomic<bool> diverged(false);
+        std::vector<std::function<void()>> tasks;
+        for (int i = 0; i < conditions.size(); i++) {
+            tasks.push_back([&, i]() {
+                double end = real_data[i].times[real_data[i].times.size() - 1];
+                try {
+                    model[i] = Masses(conditions[i], params, end, integrator, DEFAULT_POINTS, false);
+                } catch (std::runtime_error&) {
+                    diverged = true; // the only way a run without checkpoint fails
+                    return;
+                }
+                model[i].normalize(end);
+            });
+        }
+        pool.run(tasks);
+        error = diverged ? INFINITY : MSE(real_data, model);
+    } else {
+        error = INFINITY;
+    }
+    if (cache) cache->insert(key, error);
+    return error;
+}
+
+// With speculative set, reflection, expansion and both contractions are
+// evaluated at once; the accepted point is the same as in the serial order.
+// simplex, if given, receives the final vertices from best to worst.
+std::pair<Params, double> globalFit(std::vector<Masses> real_data, std::vector<Params> params_vec, std::vector<Conditions> initials, Integrator integrator, ThreadPool& pool, bool speculative = false, EvalCache* cache = nullptr, bool early_abort = false, Checkpoint* checkpoint = nullptr, int iterations = FIT_ITERATIONS, std::vector<Params>* simplex = nullptr) {
+    for (int i = 0; i < real_data.size(); i++) {
+        real_data[i].normalize(real_data[i].times[real_data[i].times.size() - 1]);
+    }
+    uint64_t context = cache ? EvalCache::context(initials, real_data, integrator) : 0;
+    std::vector<std::pair<Params,double>> guesses;
+    guesses.resize(params_vec.size());
+    std::vector<std::function<void()>> tasks;
+    int first = 0;
+    // The simplex and its errors are all a resumed fit needs
+    auto save = [&](int iteration) {
+        checkpoint->begin();
+        checkpoint->put(iteration);
+        checkpoint->put(guesses.size());
+        for (int j = 0; j < guesses.size(); j++) {
+            for (int k = 0; k < PARAM_COUNT; k++) checkpoint->put(guesses[j].first.component(k));
+            checkpoint->put(guesses[j].second);
+        }
+        checkpoint->commit();
+    };
+    if (checkpoint && checkpoint->resuming()) {
+        first = checkpoint->get();
+        guesses.resize((std::size_t) checkpoint->get());
+        for (int j = 0; j < guesses.size(); j++) {
+            for (int k = 0; k < PARAM_COUNT; k++) guesses[j].first.component(k) = checkpoint->get();
+            guesses[j].second = checkpoint->get();
+        }
+        checkpoint->resumed();
+        params_vec.clear();
+    }
+    for (int i = 0; i < params_vec.size(); i++) {
+        tasks.push_back([&, i]() {
+            guesses[i] = std::make_pair(params_vec[i], calc_error(
+                        params_vec[i], initials, real_data, integrator, pool, cache, context
+                        )
+                    );
+        });
+    }
+    pool.run(tasks);
+    bool debug = logging(LogLevel::debug);
+    for (int i = 0; debug && i < params_vec.size(); i++) {
+        guesses[i].first.print();
+        std::cout << guesses[i].second << '\n';
+    }
+    for (int i = first; i < iterations; i++) {
+        if (checkpoint && checkpoint->due()) save(i);
+        // Counts the whole iteration as the operation that ends it
+        Metrics::Timer timer(metrics, Operation::reflect);
+        std::sort(guesses.begin(), guesses.end(),
+                [](std::pair<Params, double> a, std::pair<Params, double> b) {
+                return a.second < b.second;
+                });
+        if (debug) {
+            std::cout << "Ordered guesses" << '\n';
+            for (int i = 0; i < guesses.size(); i++) {
+                guesses[i].first.print();
+                std::cout << guesses[i].second << '\n';
+            }
+        }
+        // Find the centroid
+        Params centroid;
+        for (int j = 0; j < guesses.size() - 1; j++) {
+            centroid = centroid + guesses[j].first;
+        }
+        centroid = centroid * (1.0 / (guesses.size() - 1));
+        if (debug) {
+            std::cout << "Centroid" << '\n';
+            centroid.print();
+        }
+        // Reflect point
+        Params reflection = centroid + centroid - guesses[guesses.size() - 1].first;
+        Params expansion = centroid + ( (reflection - centroid) * 2 );
+        Params in_contraction = centroid + ( (guesses[guesses.size() - 1].first - centroid) * 0.5 );
+        Params out_contraction = centroid + ( (reflection - centroid) * 0.5 );
+        double refl_error, expa_error, in_cont_error, out_cont_error;
+        // Errors that cannot change the outcome below
+        double worst = early_abort ? guesses[guesses.size() - 1].second : INFINITY;
+        double best = early_abort ? guesses[0].second : INFINITY;
+        if (speculative) {
+            tasks = {
+                [&]() { refl_error = calc_error(reflection, initials, real_data, integrator, pool, cache, context, worst); },
+                [&]() { expa_error = calc_error(expansion, initials, real_data, integrator, pool, cache, context, best); },
+                [&]() { in_cont_error = calc_error(in_contraction, initials, real_data, integrator, pool, cache, context, worst); },
+                [&]() { out_cont_error = calc_error(out_contraction, initials, real_data, integrator, pool, cache, context, worst); }
+            };
+            pool.run(tasks);
+        }
+        if (!speculative) refl_error = calc_error(reflection, initials, real_data, integrator, pool, cache, context, worst);
+        if (debug) {
+            std::cout << "Reflection" << '\n';
+            reflection.print();
+            std::cout << "Error: " << refl_error << '\n';
+        }
+        if (refl_error < guesses[guesses.size() - 1].second && refl_error > guesses[0].second) {
+            // Reflection is good
+            guesses[guesses.size() - 1].first = reflection;
+            guesses[guesses.size() - 1].second = refl_error;
+            continue;
+        } else if (refl_error <= guesses[0].second) {
+            // Reflection is reall good, try expanding
+            timer.operation = Operation::expand;
+            if (!speculative) expa_error = calc_error(expansion, initials, real_data, integrator, pool, cache, context, early_abort ? refl_error : INFINITY);
+            if (debug) {
+                std::cout << "Expansion" << '\n';
+                expansion.print();
+                std::cout << "Error: " << expa_error << '\n';
+            }
+            if (expa_error < refl_error) {
+                guesses[guesses.size() - 1].first = expansion;
+                guesses[guesses.size() - 1].second = expa_error;
+            } else {
+                guesses[guesses.size() - 1].first = reflection;
+                guesses[guesses.size() - 1].second = refl_error;
+            }
+            continue;
+        }
+        // Reflection is bad, try contraction instead
+        timer.operation = Operation::contract;
+        if (!speculative) in_cont_error = calc_error(in_contraction, initials, real_data, integrator, pool, cache, context, worst);
+        if (!speculative) out_cont_error = calc_error(out_contraction, initials, real_data, integrator, pool, cache, context, std::min(worst, in_cont_error));
+        if (debug) {
+            std::cout << "Contraction (inside)" << '\n';
+            in_contraction.print();
+            std::cout << "Error: " << in_cont_error << '\n';
+            std::cout << "Contraction (outside)" << '\n';
+            out_contraction.print();
+            std::cout << "Error: " << out_cont_error << '\n';
+        }
+        if (in_cont_error < guesses[guesses.size() - 1].second) {
             if (in_cont_error < out_cont_error) {
                 guesses[guesses.size() - 1].first = in_contraction;
                 guesses[guesses.size() - 1].second = in_cont_error;
@@ -480,71 +2760,988 @@ Params globalFit(std::vector<Masses> real_data, std::vector<Params> params_vec,
             continue;
         }
         // Contractions are bad, shrink instead
+        timer.operation = Operation::shrink;
+        tasks.clear();
         for (int j = 1; j < guesses.size(); j++) {
             guesses[j].first = guesses[0].first + ( (guesses[j].first - guesses[0].first) * 0.5 );
-            guesses[j].second = calc_error(guesses[j].first, initials, real_data, step_size);
+            tasks.push_back([&, j]() {
+                guesses[j].second = calc_error(guesses[j].first, initials, real_data, integrator, pool, cache, context);
+            });
         }
+        pool.run(tasks);
     }
+    if (checkpoint) save(iterations);
     std::sort(guesses.begin(), guesses.end(),
             [](std::pair<Params, double> a, std::pair<Params, double> b) {
             return a.second < b.second;
             });
-    std::cout << "Final guesses" << std::endl;
-    for (int i = 0; i < guesses.size(); i++) {
+    if (logging(LogLevel::info)) std::cout << "Final guesses" << std::endl;
+    for (int i = 0; logging(LogLevel::info) && i < guesses.size(); i++) {
         guesses[i].first.print();
         std::cout << guesses[i].second << std::endl;
     }
-    return guesses[0].first;
+    if (simplex) {
+        simplex->clear();
+        for (int i = 0; i < guesses.size(); i++) simplex->push_back(guesses[i].first);
+    }
+    return guesses[0];
+}
+
+static const double SEED_STEP = 0.05; // relative change of the one component a seeded vertex moves
+
+// Independent simplices built from consecutive groups of rows of params_vec,
+// run side by side; the best fit among them is returned. Every row is used,
+// the first size % starts groups taking one more. With several starts, a group
+// short of PARAM_COUNT + 1 rows is filled up with copies of its first row,
+// each with one more nonzero component changed by SEED_STEP.
+std::pair<Params, double> multiStartFit(std::vector<Masses>& real_data, std::vector<Params>& params_vec, std::vector<Conditions>& initials, Integrator& integrator, ThreadPool& pool, int starts, bool speculative, EvalCache* cache = nullptr, bool early_abort = false, const char* checkpoint_name = nullptr, bool resume = false, double interval = CHECKPOINT_INTERVAL) {
+    starts = std::max(1, starts);
+    int size = params_vec.size();
+    if (starts > size) {
+        throw std::runtime_error("--starts=" + std::to_string(starts) + " needs a params row to seed each simplex, and the params file has " + std::to_string(size));
+    }
+    std::vector<std::vector<Params>> groups(starts);
+    for (int s = 0, row = 0; s < starts; s++) {
+        int count = size / starts + (s < size % starts);
+        groups[s].assign(params_vec.begin() + row, params_vec.begin() + row + count);
+        row += count;
+        for (int k = 0; starts > 1 && k < PARAM_COUNT && groups[s].size() < PARAM_COUNT + 1; k++) {
+            Params seeded = groups[s][0];
+            if (seeded.component(k) == 0) continue; // zero components stay fixed
+            seeded.component(k) *= 1 + SEED_STEP;
+            groups[s].push_back(seeded);
+        }
+    }
+    std::vector<std::pair<Params, double>> results(starts);
+    std::vector<std::unique_ptr<Checkpoint>> checkpoints(starts);
+    for (int s = 0; s < starts && checkpoint_name; s++) {
+        std::string name = starts > 1 ? std::string(checkpoint_name) + "." + std::to_string(s) : std::string(checkpoint_name);
+        checkpoints[s].reset(new Checkpoint(name, resume, interval));
+        checkpoints[s]->row = s;
+        // Checked here, before any simplex starts, rather than inside the tasks
+        long saved_row;
+        std::vector<double> values;
+        if (!checkpoints[s]->snapshot(saved_row, values)) continue;
+        int group = groups[s].size();
+        std::size_t expected = 2 + group * (PARAM_COUNT + 1); // iteration, vertex count, then each vertex and its error
+        if (saved_row != s || values.size() != expected || values[1] != group || !(values[0] >= 0 && values[0] <= FIT_ITERATIONS)) {
+            throw std::runtime_error("Checkpoint " + name + " does not match this run");
+        }
+    }
+    std::vector<std::function<void()>> tasks;
+    for (int s = 0; s < starts; s++) {
+        tasks.push_back([&, s]() {
+            results[s] = globalFit(real_data, groups[s], initials, integrator, pool, speculative, cache, early_abort, checkpoints[s].get());
+        });
+    }
+    pool.run(tasks);
+    int best = 0;
+    for (int s = 1; s < starts; s++) {
+        if (results[s].second < results[best].second) best = s;
+    }
+    return results[best];
+}
+
+// Gaussian elimination with partial pivoting on a dense size x size system,
+// false if it is singular
+bool solve_dense(std::vector<double> A, std::vector<double>& b, int size) {
+    for (int c = 0; c < size; c++) {
+        int pivot = c;
+        for (int r = c + 1; r < size; r++) {
+            if (std::fabs(A[r * size + c]) > std::fabs(A[pivot * size + c])) pivot = r;
+        }
+        if (!(A[pivot * size + c] != 0)) return false;
+        for (int k = 0; k < size; k++) std::swap(A[c * size + k], A[pivot * size + k]);
+        std::swap(b[c], b[pivot]);
+        for (int r = c + 1; r < size; r++) {
+            double factor = A[r * size + c] / A[c * size + c];
+            for (int k = c; k < size; k++) A[r * size + k] -= factor * A[c * size + k];
+            b[r] -= factor * b[c];
+        }
+    }
+    for (int c = size - 1; c >= 0; c--) {
+        for (int k = c + 1; k < size; k++) b[c] -= A[c * size + k] * b[k];
+        b[c] /= A[c * size + c];
+    }
+    return true;
+}
+
+// Normalized model minus data at every data time, exactly as the aligned
+// calc_error compares them. With a jacobian, also the derivatives of each
+// residual with respect to the log of every free parameter, one row of
+// free.size() values per data point, from the sensitivity equations.
+double lm_residuals(Params& params, std::vector<int>& free, std::vector<Conditions>& conditions, std::vector<Masses>& real_data, Integrator& integrator, ThreadPool& pool, std::vector<double>& residuals, std::vector<double>* jacobian) {
+    int f = free.size();
+    if (metrics.enabled) (jacobian ? metrics.sensitivities : metrics.evaluations)++;
+    std::vector<int> offset(conditions.size() + 1, 0);
+    for (int i = 0; i < conditions.size(); i++) offset[i + 1] = offset[i] + real_data[i].times.size();
+    residuals.assign(offset[conditions.size()], 0);
+    if (jacobian) jacobian->assign(offset[conditions.size()] * f, 0);
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < conditions.size(); i++) {
+        tasks.push_back([&, i]() {
+            Masses& data = real_data[i];
+            int total = data.times.size();
+            Integrator local = integrator;
+            local.aligned = true;
+            Conditions state = conditions[i];
+            state.measure(params);
+            std::vector<Conditions> S(jacobian ? f : 0, Conditions(state.agg.size()));
+            std::vector<Params> directions(S.size());
+            for (int p = 0; p < S.size(); p++) directions[p].component(free[p]) = params.component(free[p]);
+            if (jacobian) local.track(&S, &directions);
+            std::vector<double> m(total);
+            std::vector<double> dm(jacobian ? total * f : 0);
+            double time = 0;
+            bool settled = false;
+            for (int j = 0; j < total; j++) {
+                if (settled) {
+                    m[j] = m[j - 1];
+                    for (int p = 0; jacobian && p < f; p++) dm[j * f + p] = dm[(j - 1) * f + p];
+                    continue;
+                }
+                local.advance(state, params, time, data.times[j]);
+                m[j] = local.diverged ? NAN : local.mass(state, params); // the error is then nan and the step refused
+                settled = local.settled(state, params, time, data.times[total - 1]);
+                if (!jacobian) continue;
+                for (int p = 0; p < f; p++) {
+                    double d = directions[p].n * state.count;
+                    for (int k = 0; k < S[p].agg.size(); k++) d += (params.n + bins.size(k)) * S[p].agg[k];
+                    dm[j * f + p] = d;
+                }
+            }
+            double N = m[total - 1];
+            for (int j = 0; j < total; j++) {
+                residuals[offset[i] + j] = m[j] / N - data.mass(j);
+                if (!jacobian) continue;
+                for (int p = 0; p < f; p++) {
+                    (*jacobian)[(offset[i] + j) * f + p] = (dm[j * f + p] * N - m[j] * dm[(total - 1) * f + p]) / (N * N);
+                }
+            }
+        });
+    }
+    pool.run(tasks);
+    double error = 0;
+    for (int j = 0; j < residuals.size(); j++) error += residuals[j] * residuals[j];
+    return error / residuals.size();
+}
+
+static const int LM_ITERATIONS = 100;
+static const double LM_MAX_STEP = 2; // largest change of a log parameter per step
+static const double LM_TOLERANCE = 1e-4; // relative improvement below which a step ends the fit
+
+// Levenberg-Marquardt on the logs of the positive parameters of start; zero
+// parameters stay fixed. real_data must already be normalized.
+std::pair<Params, double> levenbergMarquardt(std::vector<Masses>& real_data, Params params, std::vector<Conditions>& initials, Integrator& integrator, ThreadPool& pool, long& evaluations, long& jacobians) {
+    std::vector<int> free, none;
+    for (int p = 0; p < PARAM_COUNT; p++) {
+        if (params.component(p) > 0) free.push_back(p);
+    }
+    int f = free.size();
+    std::vector<double> residuals, jacobian, trial_residuals;
+    double lambda = 1e-3;
+    double error = INFINITY;
+    for (int iteration = 0; iteration < LM_ITERATIONS; iteration++) {
+        error = lm_residuals(params, free, initials, real_data, integrator, pool, residuals, &jacobian);
+        jacobians++;
+        if (logging(LogLevel::info)) {
+            std::cout << "Iteration " << iteration << '\n';
+            params.print();
+            std::cout << "Error: " << error << std::endl;
+        }
+        if (!(error < INFINITY)) break;
+        std::vector<double> normal(f * f, 0), gradient(f, 0);
+        for (int j = 0; j < residuals.size(); j++) {
+            const double* row = &jacobian[j * f];
+            for (int a = 0; a < f; a++) {
+                gradient[a] -= row[a] * residuals[j];
+                for (int b = 0; b < f; b++) normal[a * f + b] += row[a] * row[b];
+            }
+        }
+        bool improved = false;
+        double trial_error = error;
+        while (lambda < 1e12) {
+            std::vector<double> damped = normal;
+            for (int a = 0; a < f; a++) damped[a * f + a] += lambda * std::max(normal[a * f + a], 1e-30);
+            std::vector<double> delta = gradient;
+            if (solve_dense(damped, delta, f)) {
+                // Poorly determined parameters get huge Gauss-Newton steps;
+                // clipping them one by one keeps the rest of the step useful
+                Params trial = params;
+                for (int a = 0; a < f; a++) trial.component(free[a]) *= std::exp(std::max(-LM_MAX_STEP, std::min(LM_MAX_STEP, delta[a])));
+                trial_error = lm_residuals(trial, none, initials, real_data, integrator, pool, trial_residuals, nullptr);
+                evaluations++;
+                if (trial_error < error) {
+                    params = trial;
+                    lambda = std::max(lambda / 10, 1e-12);
+                    improved = true;
+                    break;
+                }
+            }
+            lambda *= 10;
+        }
+        if (!improved) break;
+        bool converged = error - trial_error < LM_TOLERANCE * error;
+        error = trial_error;
+        if (converged) break;
+    }
+    return std::make_pair(params, error);
+}
+
+// Runs Levenberg-Marquardt from every positive row of params_vec side by side
+// and keeps the best end point. The gradient is only as smooth as the
+// integration, so atol should sit well below the smallest aggregate masses.
+std::pair<Params, double> lmFit(std::vector<Masses> real_data, std::vector<Params>& params_vec, std::vector<Conditions>& initials, Integrator& integrator, ThreadPool& pool) {
+    for (int i = 0; i < real_data.size(); i++) {
+        real_data[i].normalize(real_data[i].times[real_data[i].times.size() - 1]);
+    }
+    std::vector<std::pair<Params, double>> results(params_vec.size(), std::make_pair(Params(), INFINITY));
+    std::vector<long> evaluations(params_vec.size(), 0), jacobians(params_vec.size(), 0);
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < params_vec.size(); i++) {
+        if (!params_vec[i].is_positive()) continue;
+        tasks.push_back([&, i]() {
+            results[i] = levenbergMarquardt(real_data, params_vec[i], initials, integrator, pool, evaluations[i], jacobians[i]);
+        });
+    }
+    pool.run(tasks);
+    int best = 0;
+    long total = 0, total_jacobians = 0;
+    for (int i = 0; i < params_vec.size(); i++) {
+        if (results[i].second < results[best].second) best = i;
+        total += evaluations[i];
+        total_jacobians += jacobians[i];
+    }
+    if (logging(LogLevel::info)) {
+        std::cout << "Final" << '\n';
+        results[best].first.print();
+        std::cout << "Error: " << results[best].second << '\n';
+        std::cout << "Model evaluations: " << total << " plus " << total_jacobians << " with sensitivities" << std::endl;
+    }
+    return results[best];
+}
+
+static const int BOOTSTRAP_REFITS = 50;
+static const uint64_t BOOTSTRAP_SEED = 1; // refit b resamples with seed + b, so reruns match
+static const double PROFILE_DECADES = 1; // reach of the profile grid either side of the best value
+static const double CONFIDENCE = 0.95;
+static const double PROFILE_CHI2 = 3.841; // chi-square quantile at CONFIDENCE for one degree of freedom
+static const char* COMPONENT_NAMES[PARAM_COUNT] = {"n", "r", "forward[0]", "forward[1]", "forward[2]", "backward[0]", "backward[1]", "backward[2]"};
+
+// Bootstrap refits on resampled data points and profile-likelihood scans of
+// the rate constants, all warm-started from the final simplex of the best fit
+// and run side by side on the pool. Each refit is appended to file_name as it
+// ends, then the intervals at CONFIDENCE: percentiles of the refits, and the
+// profile grid values whose error stays within the likelihood-ratio bound.
+void uncertainty(std::vector<Masses>& real_data, std::vector<Params>& params_vec, std::vector<Conditions>& initials, Integrator& integrator, ThreadPool& pool, int refits, int profile_points, bool speculative, EvalCache* cache, bool early_abort, const std::string& file_name) {
+    std::ofstream output(file_name, std::ofstream::out | std::ofstream::trunc);
+    if (!output) throw std::runtime_error("Cannot write " + file_name);
+    std::mutex mutex;
+    bool failed = false;
+    auto write = [&](const std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        output << line << '\n';
+        output.flush();
+        if (!output) failed = true;
+    };
+    auto number = [](double value) {
+        char text[32];
+        return std::string(text, std::snprintf(text, sizeof(text), "%.10g", value));
+    };
+    auto row = [&](Params params, double error) {
+        std::string line;
+        for (int k = 0; k < PARAM_COUNT; k++) line += number(params.component(k)) + " ";
+        return line + number(error);
+    };
+    std::vector<Params> simplex;
+    std::pair<Params, double> best = globalFit(real_data, params_vec, initials, integrator, pool, speculative, cache, early_abort, nullptr, FIT_ITERATIONS, &simplex);
+    write("best " + row(best.first, best.second));
+
+    // Resampling draws from the normalized points; every draw keeps the last
+    // one, which the refit normalizes by
+    std::vector<Masses> data = real_data;
+    int points = 0;
+    for (int i = 0; i < data.size(); i++) {
+        data[i].normalize(data[i].times[data[i].times.size() - 1]);
+        points += data[i].times.size();
+    }
+    std::vector<std::pair<Params, double>> fits(refits, std::make_pair(Params(), INFINITY));
+    int profiled = profile_points;
+    std::vector<std::vector<double>> profile(PARAM_COUNT, std::vector<double>(2 * profiled + 1, INFINITY));
+    auto grid = [&](int k, int g) {
+        return best.first.component(k) * std::pow(10.0, PROFILE_DECADES * g / profiled);
+    };
+    // Each refit would print its final simplex
+    bool progress = logging(LogLevel::info);
+    LogLevel level = log_level;
+    if (level == LogLevel::info) log_level = LogLevel::quiet;
+    std::atomic<int> finished(0);
+    int jobs = 0;
+    std::vector<std::function<void()>> tasks;
+    for (int b = 0; b < refits; b++) {
+        jobs++;
+        tasks.push_back([&, b]() {
+            std::mt19937_64 random(BOOTSTRAP_SEED + b);
+            std::vector<Masses> sample;
+            for (int i = 0; i < data.size(); i++) {
+                int total = data[i].times.size();
+                std::uniform_int_distribution<int> pick(0, std::max(total - 2, 0));
+                std::vector<int> chosen;
+                for (int j = 0; j + 1 < total; j++) chosen.push_back(pick(random));
+                chosen.push_back(total - 1);
+                std::sort(chosen.begin(), chosen.end());
+                std::vector<double> times, masses;
+                for (int j = 0; j < chosen.size(); j++) {
+                    times.push_back(data[i].times[chosen[j]]);
+                    masses.push_back(data[i].mass(chosen[j]));
+                }
+                sample.push_back(Masses(times, masses));
+            }
+            // resampled data never comes back, so its evaluations are not cached
+            fits[b] = globalFit(sample, simplex, initials, integrator, pool, speculative, nullptr, early_abort);
+            write("bootstrap " + std::to_string(b) + " " + row(fits[b].first, fits[b].second));
+            if (progress) std::printf("Refit %d of %d done\n", ++finished, jobs);
+        });
+    }
+    for (int k = 2; profiled > 0 && k < PARAM_COUNT; k++) {
+        if (!(best.first.component(k) > 0)) continue;
+        for (int g = -profiled; g <= profiled; g++) {
+            if (g == 0) {
+                profile[k][profiled] = best.second;
+                continue;
+            }
+            jobs++;
+            tasks.push_back([&, k, g]() {
+                std::vector<Params> start = simplex;
+                for (int v = 0; v < start.size(); v++) start[v].component(k) = grid(k, g);
+                std::pair<Params, double> fit = globalFit(real_data, start, initials, integrator, pool, speculative, cache, early_abort);
+                profile[k][g + profiled] = fit.second;
+                write("profile " + std::string(COMPONENT_NAMES[k]) + " " + number(grid(k, g)) + " " + row(fit.first, fit.second));
+                if (progress) std::printf("Refit %d of %d done\n", ++finished, jobs);
+            });
+        }
+    }
+    pool.run(tasks);
+    log_level = level;
+
+    for (int k = 0; k < PARAM_COUNT && refits > 0; k++) {
+        std::vector<double> values;
+        for (int b = 0; b < refits; b++) {
+            if (std::isfinite(fits[b].second)) values.push_back(fits[b].first.component(k));
+        }
+        if (values.size() < 2) continue;
+        std::sort(values.begin(), values.end());
+        auto percentile = [&](double p) {
+            double position = p * (values.size() - 1);
+            int below = (int) position;
+            if (below + 1 >= values.size()) return values.back();
+            return values[below] + (position - below) * (values[below + 1] - values[below]);
+        };
+        write("interval " + std::string(COMPONENT_NAMES[k]) + " bootstrap " + number(percentile((1 - CONFIDENCE) / 2)) + " " + number(percentile((1 + CONFIDENCE) / 2)));
+    }
+    // Refits keep improving on the best fit, so the lowest error of any scan
+    // stands in for the minimum. A bound at the edge of the grid is marked
+    // open, the scan never left the region.
+    double lowest = best.second;
+    for (int k = 0; k < PARAM_COUNT; k++) {
+        for (int g = 0; g < profile[k].size(); g++) lowest = std::min(lowest, profile[k][g]);
+    }
+    double bound = lowest * std::exp(PROFILE_CHI2 / points);
+    for (int k = 2; profiled > 0 && k < PARAM_COUNT; k++) {
+        if (!(best.first.component(k) > 0)) continue;
+        int low = 0, high = 0;
+        while (low > -profiled && profile[k][low - 1 + profiled] <= bound) low--;
+        while (high < profiled && profile[k][high + 1 + profiled] <= bound) high++;
+        bool open = low == -profiled || high == profiled;
+        write("interval " + std::string(COMPONENT_NAMES[k]) + " profile " + number(grid(k, low)) + " " + number(grid(k, high)) + (open ? " open" : ""));
+    }
+    if (failed) throw std::runtime_error("Cannot write " + file_name);
+}
+
+// Comma separated data files, binary or text, in one list of datasets
+std::vector<Masses> read_data(const char* file_names) {
+    std::vector<Masses> real_data;
+    std::stringstream names(file_names);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(name);
+        if (mapped->is_binary()) {
+            real_data.push_back(Masses(mapped));
+        } else {
+            std::vector<Masses> datasets = read_masses(mapped, name);
+            real_data.insert(real_data.end(), datasets.begin(), datasets.end());
+        }
+    }
+    return real_data;
+}
+
+static const double BENCH_SECONDS = 0.5; // least time measured per benchmark
+static const int BENCH_LENGTHS[] = {10, 50, 200, 400, 1000};
+static const int BENCH_ITERATIONS = 5;
+
+// Seconds per call of run, repeating it until BENCH_SECONDS have passed
+double seconds_per_call(const std::function<void()>& run) {
+    long calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    for (long batch = 1; elapsed < BENCH_SECONDS; batch *= 2) {
+        for (long i = 0; i < batch; i++) run();
+        calls += batch;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return elapsed / calls;
+}
+
+// Times the hot paths on fixed inputs and writes one JSON object, so runs of
+// different builds, kernels or integrators can be compared directly:
+// single chain steps at several lengths, Masses generation and calc_error
+// for the first params row, and the first BENCH_ITERATIONS Nelder-Mead
+// iterations. The Masses and fit numbers follow the integrator flags.
+void bench(std::vector<Params>& params, std::vector<Conditions>& conditions, std::vector<Masses>& real_data, double time_length, Integrator& integrator, ThreadPool& pool, const std::string& file_name) {
+    static const char* METHODS[] = {"euler", "rk45", "ros2"};
+    std::ofstream output(file_name, std::ofstream::out | std::ofstream::trunc);
+    char line[256];
+    auto write = [&](int length) {
+        output.write(line, length);
+        std::cout.write(line, length);
+    };
+    write(std::snprintf(line, sizeof(line), "{\n  \"simd\": \"%s\",\n  \"threads\": %u,\n  \"method\": \"%s\",\n  \"step_size\": %g,\n  \"rtol\": %g,\n  \"atol\": %g,\n  \"benchmarks\": [\n",
+                SIMD_LEVEL.c_str(), pool.size(), METHODS[(int) integrator.method], integrator.step_size, integrator.rtol, integrator.atol));
+    Params& reference = params[0];
+    for (int length : BENCH_LENGTHS) {
+        Conditions A(length), B;
+        A.im = conditions[0].im;
+        A.am = 1e-6;
+        for (int i = 0; i < length; i++) A.agg[i] = 1e-9 / (i + 1);
+        double euler = seconds_per_call([&]() { become_next(A, B, reference, integrator.step_size); });
+        double next = seconds_per_call([&]() { B = A.next(reference, integrator.step_size); });
+        double derivative = seconds_per_call([&]() { rates(A, B, reference); });
+        write(std::snprintf(line, sizeof(line), "    {\"name\": \"become_next\", \"length\": %d, \"steps_per_second\": %.6g},\n", length, 1 / euler));
+        write(std::snprintf(line, sizeof(line), "    {\"name\": \"Conditions::next\", \"length\": %d, \"steps_per_second\": %.6g},\n", length, 1 / next));
+        write(std::snprintf(line, sizeof(line), "    {\"name\": \"rates\", \"length\": %d, \"calls_per_second\": %.6g},\n", length, 1 / derivative));
+    }
+    Integrator counted = integrator;
+    auto start = std::chrono::steady_clock::now();
+    Masses masses(conditions[0], reference, time_length, counted, DEFAULT_POINTS, false);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long steps = counted.method == Method::euler ? std::lround(time_length / counted.step_size) : 0;
+    write(std::snprintf(line, sizeof(line), "    {\"name\": \"Masses\", \"time_length\": %g, \"seconds\": %.6g, \"final_mass\": %.17g%s},\n",
+                time_length, seconds, masses.mass(masses.times.size() - 1), steps ? (", \"steps_per_second\": " + std::to_string(steps / seconds)).c_str() : ""));
+    std::vector<Masses> normalized = real_data;
+    for (int i = 0; i < normalized.size(); i++) normalized[i].normalize(normalized[i].times[normalized[i].times.size() - 1]);
+    double error = 0;
+    double per_error = seconds_per_call([&]() { error = calc_error(reference, conditions, normalized, integrator, pool); });
+    write(std::snprintf(line, sizeof(line), "    {\"name\": \"calc_error\", \"datasets\": %d, \"seconds\": %.6g, \"error\": %.17g},\n",
+                (int) normalized.size(), per_error, error));
+    std::vector<Params> vertices(params.begin(), params.end());
+    std::streambuf* console = std::cout.rdbuf(nullptr); // the fit's own dumps are not part of the result
+    start = std::chrono::steady_clock::now();
+    std::pair<Params, double> fit = globalFit(real_data, vertices, conditions, integrator, pool, false, nullptr, false, nullptr, BENCH_ITERATIONS);
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout.rdbuf(console);
+    write(std::snprintf(line, sizeof(line), "    {\"name\": \"globalFit\", \"iterations\": %d, \"seconds_per_iteration\": %.6g, \"error\": %.17g}\n  ]\n}\n",
+                BENCH_ITERATIONS, seconds / BENCH_ITERATIONS, fit.second));
+}
+
+static const char* MANIFEST_SUFFIX = ".manifest";
+static const char* PART_SUFFIX = ".part";
+
+// Runs one gen job per params row on the pool, which hands out jobs as
+// threads free up, so a few slow rows never leave the other cores idle.
+// Each job streams its csv, as gen would write it, into file_name.<job>.part;
+// finished parts are appended to file_name in the order they finish and removed. The manifest next to it starts with "sweep <jobs>
+// <hash of the inputs>" and gets a "done <job> <offset> <bytes> <seconds>"
+// line once a job's output is written; jobs not listed are still pending.
+// Rerunning the same sweep skips the listed jobs and drops any output
+// appended after them.
+void sweep(std::vector<Params>& params, std::vector<Conditions>& conditions, bool conc, double time_length, Integrator& integrator, int points, ThreadPool& pool, const std::string& file_name) {
+    std::vector<Masses> no_data;
+    uint64_t hash = EvalCache::context(conditions, no_data, integrator);
+    hash = EvalCache::mix(hash, conc);
+    hash = EvalCache::mix(hash, time_length);
+    hash = EvalCache::mix(hash, points);
+    for (int i = 0; i < params.size(); i++) {
+        for (int k = 0; k < PARAM_COUNT; k++) hash = EvalCache::mix(hash, params[i].component(k));
+    }
+    std::string manifest_name = file_name + MANIFEST_SUFFIX;
+    std::vector<bool> done(params.size(), false);
+    std::string listed = "sweep " + std::to_string(params.size()) + " " + std::to_string(hash) + "\n";
+    std::uintmax_t end = 0;
+    int finished = 0;
+    std::ifstream previous(manifest_name);
+    if (previous) {
+        std::string word, line;
+        std::size_t jobs = 0;
+        uint64_t saved = 0;
+        if (!(previous >> word >> jobs >> saved) || word != "sweep" || jobs != params.size() || saved != hash) {
+            throw std::runtime_error(manifest_name + " belongs to another sweep, remove it and " + file_name + " to start over");
+        }
+        long job;
+        double offset, bytes, seconds;
+        // A line cut short by a crash ends the list
+        while (std::getline(previous, line)) {
+            std::istringstream fields(line);
+            if (!(fields >> word >> job >> offset >> bytes >> seconds) || word != "done" || job < 0 || job >= params.size()) continue;
+            if (done[job]) continue;
+            done[job] = true;
+            finished++;
+            end = std::max(end, (std::uintmax_t) (offset + bytes));
+            listed += line + "\n";
+        }
+        previous.close();
+        if (!std::filesystem::exists(file_name) || std::filesystem::file_size(file_name) < end) throw std::runtime_error(file_name + " is shorter than its manifest");
+        std::filesystem::resize_file(file_name, end);
+        if (logging(LogLevel::info)) std::cout << "Resuming sweep, " << finished << " of " << params.size() << " jobs done" << std::endl;
+    } else {
+        std::ofstream(file_name, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+    }
+    {
+        // Rewritten whole so that a torn last line cannot stay in the list
+        std::ofstream fresh(manifest_name + ".tmp", std::ofstream::out | std::ofstream::trunc);
+        fresh << listed;
+        fresh.close();
+        if (!fresh) throw std::runtime_error("Cannot write " + manifest_name);
+        std::filesystem::rename(manifest_name + ".tmp", manifest_name);
+    }
+    std::ofstream output(file_name, std::ofstream::out | std::ofstream::app | std::ofstream::binary);
+    std::ofstream manifest(manifest_name, std::ofstream::out | std::ofstream::app);
+    if (!output || !manifest) throw std::runtime_error("Cannot append to " + file_name);
+    std::mutex mutex;
+    bool failed = false;
+    int resumed = finished;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < params.size(); i++) {
+        if (done[i]) continue;
+        tasks.push_back([&, i]() {
+            auto job_start = std::chrono::steady_clock::now();
+            Conditions& initial = conditions[i % conditions.size()];
+            std::string part_name = file_name + "." + std::to_string(i) + PART_SUFFIX;
+            {
+                std::ofstream part(part_name, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+                if (conc) {
+                    Concentrations concentrations(initial, params[i], time_length, integrator, points);
+                    concentrations.stream([&](std::string& piece) {
+                        part.write(piece.data(), piece.size());
+                        return (bool) part;
+                    });
+                } else {
+                    Masses(initial, params[i], time_length, integrator, points > 0 ? points : DEFAULT_POINTS, false).write(part);
+                }
+                if (!part) throw std::runtime_error("Cannot write " + part_name);
+            }
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - job_start).count();
+            std::ifstream part(part_name, std::ifstream::in | std::ifstream::binary);
+            std::vector<char> chunk(OUTPUT_BUFFER);
+            long rows = 0;
+            std::lock_guard<std::mutex> lock(mutex);
+            std::uintmax_t offset = end;
+            while (part.read(chunk.data(), chunk.size()) || part.gcount() > 0) {
+                output.write(chunk.data(), part.gcount());
+                rows += std::count(chunk.data(), chunk.data() + part.gcount(), '\n');
+                end += part.gcount();
+            }
+            part.close();
+            output.flush();
+            std::filesystem::remove(part_name);
+            manifest << "done " << i << ' ' << offset << ' ' << end - offset << ' ' << seconds << '\n';
+            manifest.flush();
+            if (!output || !manifest) failed = true;
+            finished++;
+            if (logging(LogLevel::info)) {
+                double elapsed = std::chrono::duration<double>(now - start).count();
+                double rate = (finished - resumed) / elapsed;
+                std::printf("Job %d done in %.3g s (%ld rows/s), %d of %zu jobs, %.3g jobs/s, about %.0f s left\n",
+                        i, seconds, std::lround(rows / seconds), finished, params.size(), rate, (params.size() - finished) / rate);
+                std::fflush(stdout);
+            }
+        });
+    }
+    pool.run(tasks);
+    if (failed) throw std::runtime_error("Cannot append to " + file_name);
+}
+
+#if KINETICS_MMAP
+static const int SERVE_REQUEST_LIMIT = 1 << 20; // bytes of one request line
+static const int SERVE_BACKLOG = 64;
+static const int SERVE_READ_TIMEOUT = 10; // seconds a client may stay silent before its request is dropped
+
+// Model of one POST /model body from server.js: initialConditions, n,
+// forwardRates, backwardRates, nm (defaults to n) and metaparameters with
+// step_size, time_length and points. metaparameters may also pick method,
+// rtol and atol, the server's flags are used otherwise.
+Concentrations read_request(const Json& body, Integrator& defaults) {
+    if (body.type != Json::object) throw std::runtime_error("expected a JSON object");
+    std::vector<double> initial = body.numbers_at("initialConditions");
+    if (initial.size() < 3) throw std::runtime_error("initialConditions needs im, am and at least one aggregate");
+    std::vector<real> agg(initial.begin() + 2, initial.end());
+    Conditions conditions(initial[0], initial[1], agg);
+    if (bins.active()) bins.lump(conditions.agg);
+    Params params;
+    params.n = body.number_at("n");
+    params.r = body.get("nm") ? body.number_at("nm") : params.n;
+    std::vector<double> forward = body.numbers_at("forwardRates");
+    std::vector<double> backward = body.numbers_at("backwardRates");
+    if (forward.size() != RATE_CONSTANTS || backward.size() != RATE_CONSTANTS) throw std::runtime_error("Incorrect number of rates");
+    std::copy(forward.begin(), forward.end(), params.forward.begin());
+    std::copy(backward.begin(), backward.end(), params.backward.begin());
+    const Json* meta = body.get("metaparameters");
+    if (!meta || meta->type != Json::object) throw std::runtime_error("expected an object for metaparameters");
+    Integrator integrator(meta->number_at("step_size"), defaults.method, defaults.rtol, defaults.atol);
+    double time_length = meta->number_at("time_length");
+    int points = meta->get("points") ? (int) meta->number_at("points") : DEFAULT_POINTS;
+    if (!(integrator.step_size > 0)) throw std::runtime_error("Step size must be a positive number");
+    if (!(time_length >= integrator.step_size)) throw std::runtime_error("Time length must be longer than step size");
+    if (meta->get("method")) {
+        std::string method = meta->string_at("method");
+        if (method == "euler") integrator.method = Method::euler;
+        else if (method == "rk45") integrator.method = Method::rk45;
+        else if (method == "ros2") integrator.method = Method::ros2;
+        else throw std::runtime_error("Unknown method " + method);
+    }
+    if (meta->get("rtol")) integrator.rtol = meta->number_at("rtol");
+    if (meta->get("atol")) integrator.atol = meta->number_at("atol");
+    return Concentrations(conditions, params, time_length, integrator, points);
+}
+
+bool send_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t sent = write(fd, data, size);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Reads one request line from the connection fd and answers it with a JSON
+// status line, {"status": "ok"} or {"error": "..."}, then on success the
+// csv of the concentrations as it is computed
+void answer(int fd, Integrator& integrator) {
+    auto start = std::chrono::steady_clock::now();
+    std::string request;
+    char chunk[4096];
+    bool timed_out = false;
+    while (request.find('\n') == std::string::npos && request.size() < SERVE_REQUEST_LIMIT) {
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR) continue;
+        timed_out = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (got <= 0) break;
+        request.append(chunk, got);
+    }
+    std::size_t bytes = 0;
+    try {
+        if (timed_out) throw std::runtime_error("Request timed out");
+        std::size_t newline = request.find('\n');
+        if (newline == std::string::npos && request.size() >= SERVE_REQUEST_LIMIT) throw std::runtime_error("Request too long");
+        Concentrations concentrations = read_request(Json::parse(request.substr(0, newline)), integrator);
+        std::string status = "{\"status\": \"ok\"}\n";
+        if (send_all(fd, status.data(), status.size())) {
+            concentrations.stream([&](std::string& csv) {
+                bytes += csv.size();
+                return send_all(fd, csv.data(), csv.size());
+            });
+        }
+    } catch (std::exception& e) {
+        std::string message = e.what(), escaped;
+        for (char c : message) {
+            if (c == '"' || c == '\\') escaped.push_back('\\');
+            if (c != '\n') escaped.push_back(c);
+        }
+        std::string status = "{\"error\": \"" + escaped + "\"}\n";
+        send_all(fd, status.data(), status.size());
+        if (logging(LogLevel::info)) std::cerr << "Rejected request: " + message + "\n";
+    }
+    close(fd);
+    if (logging(LogLevel::info)) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Served " + std::to_string(bytes) + " bytes in " + std::to_string(seconds) + " s\n" << std::flush;
+    }
+}
+
+// Listens on the Unix socket path for model requests, one per connection,
+// and queues every connection on the pool's workers as it is accepted;
+// reads time out after SERVE_READ_TIMEOUT so idle clients cannot hold a worker
+int serve(const char* path, Integrator integrator, ThreadPool& pool) {
+    std::signal(SIGPIPE, SIG_IGN); // a client that hangs up only ends its own stream
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SERVE_BACKLOG) != 0) {
+        std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    if (logging(LogLevel::info)) std::cout << "Serving on " << path << " with " << pool.size() - 1 << " workers" << std::endl;
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "Accept failed: " << std::strerror(errno) << std::endl;
+            close(listener);
+            return 1;
+        }
+        timeval timeout = {SERVE_READ_TIMEOUT, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pool.post([connection, integrator]() mutable { answer(connection, integrator); });
+    }
+}
+#endif
+
+// Optional "--name=value" flags may follow the positional arguments
+const char* get_flag(int argc, char *argv[], const char* name) {
+    int len = std::strlen(name);
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--", 2) == 0 && std::strncmp(argv[i] + 2, name, len) == 0 && argv[i][len + 2] == '=') {
+            return argv[i] + len + 3;
+        }
+    }
+    return nullptr;
 }
 
 int main(int argc, char *argv[]) {
-    // argv[1] : "gen" or "fit"
+    // argv[1] : "gen", "fit" (Nelder-Mead), "lm" (Levenberg-Marquardt with sensitivities, ros2 only) or "bench" (timings as JSON into argv[5])
     // argv[2] : params file
     // argv[3] : initial conditions
-    // argv[4] : real data file / 'mass' vs 'conc'
+    // argv[4] : real data file(s), comma separated / 'mass' vs 'conc' vs 'ensemble' (mass curves, LANES params rows at a time)
     // argv[5] : output file
-    // argv[6] : step size
+    // argv[6] : step size (first trial step for adaptive methods)
     // argv[7] : time length
+    // "sweep" runs gen (argv[4] mass or conc) for every params row on the thread pool into the one file argv[5],
+    //     indexed by argv[5].manifest, and resumes from the manifest when rerun
+    // "serve" takes only argv[2], a Unix socket path, and answers model requests from server.js on it
+    // "uncertainty" fits like "fit", then refits from the final simplex for confidence intervals, all written to argv[5]
+    // --bootstrap= : refits on resampled data points in uncertainty mode, BOOTSTRAP_REFITS by default
+    // --profile= : profile grid points either side of each fitted rate constant in uncertainty mode, 0 by default
+    // --method=euler|rk45|ros2 : fixed-step Euler, adaptive Dormand-Prince or adaptive Rosenbrock
+    // --rtol=, --atol= : error tolerances of the adaptive methods
+    // --points= : samples written by gen, 0 writes every step in conc mode
+    // --format=csv|bin : text output, or binary columns that fit can also read back as data
+    // --threads= : worker threads for fitting, defaults to PROC_COUNT
+    // --simplex=serial|parallel : evaluate Nelder-Mead candidate points one by one or speculatively at once
+    // --starts= : split the params file into this many independent simplices and keep the best fit;
+    //   every row is used, and a group short of PARAM_COUNT + 1 rows is filled up around its first row
+    // --cache= : file keeping every fit evaluation, reused by later fits on the same data and initials
+    // --checkpoint= : file that gen (mass and conc) and fit snapshot their progress to, once per --checkpoint-interval= seconds
+    // --resume= : continue a killed gen or fit run exactly from this checkpoint file, and keep checkpointing to it
+    // --sampling=grid|data : fit against DEFAULT_POINTS model samples, or against the model exactly at the data times
+    // --drift= : check the carried aggregate mass against the full sum at every sample, resetting it past this relative drift
+    // --steady= : stop a gen mass, fit or lm run once the state would change by less than this relative amount over
+    //     --steady-window= (a part of the run, STEADY_WINDOW by default) for a whole window, and hold the last mass
+    // --abort=on|off : stop simulating a candidate point once it provably cannot enter the simplex
+    // --bins=exact,ratio,largest : single sizes up to exact past the nucleus, then bins growing by ratio up to size largest;
+    //     gen conc then writes one column per chain entry (not for ensemble)
+    // --log=quiet|info|debug : no progress output, progress and results, or also every Nelder-Mead point
+    // --metrics= : file that run counters are appended to as JSON lines, once per --metrics-interval= seconds
+    if (argc < 3 || (std::strcmp(argv[1], "serve") != 0 && argc < 8)) {
+        std::cerr << "Usage: model gen|sweep|fit|lm|uncertainty|bench params initials data|mass|conc|ensemble output step time [--flags], or model serve socket [--flags]" << std::endl;
+        return 1;
+    }
+    bool serving = std::strcmp(argv[1], "serve") == 0;
+    Integrator integrator(serving ? 0 : std::atof(argv[6]));
+    if (const char* method = get_flag(argc, argv, "method")) {
+        if (std::strcmp(method, "euler") == 0) integrator.method = Method::euler;
+        else if (std::strcmp(method, "rk45") == 0) integrator.method = Method::rk45;
+        else if (std::strcmp(method, "ros2") == 0) integrator.method = Method::ros2;
+        else {
+            std::cerr << "Unknown method " << method << std::endl;
+            return 1;
+        }
+    }
+    if (const char* rtol = get_flag(argc, argv, "rtol")) integrator.rtol = std::atof(rtol);
+    if (const char* atol = get_flag(argc, argv, "atol")) integrator.atol = std::atof(atol);
+    if (const char* sampling = get_flag(argc, argv, "sampling")) integrator.aligned = std::strcmp(sampling, "data") == 0;
+    if (const char* drift = get_flag(argc, argv, "drift")) integrator.drift = std::atof(drift);
+    if (const char* steady = get_flag(argc, argv, "steady")) integrator.steady = std::atof(steady);
+    if (const char* window = get_flag(argc, argv, "steady-window")) integrator.window = std::atof(window);
+    int points = DEFAULT_POINTS;
+    bool binary = false;
+    if (const char* format = get_flag(argc, argv, "format")) binary = std::strcmp(format, "bin") == 0;
+    if (const char* points_flag = get_flag(argc, argv, "points")) points = std::atoi(points_flag);
+    unsigned int thread_count = PROC_COUNT;
+    if (const char* threads = get_flag(argc, argv, "threads")) {
+        int count = 0;
+        const char* end = threads + std::strlen(threads);
+        std::from_chars_result parsed = std::from_chars(threads, end, count);
+        if (parsed.ec != std::errc() || parsed.ptr != end || count <= 0) {
+            std::cerr << "--threads needs a positive number of threads" << std::endl;
+            return 1;
+        }
+        thread_count = count;
+    }
+    if (serving) thread_count = std::max(thread_count, 2u); // the main thread only accepts connections
+    ThreadPool pool(thread_count);
+    bool speculative = false;
+    if (const char* simplex = get_flag(argc, argv, "simplex")) speculative = std::strcmp(simplex, "parallel") == 0;
+    bool early_abort = true;
+    if (const char* abort_flag = get_flag(argc, argv, "abort")) early_abort = std::strcmp(abort_flag, "off") != 0;
+    int starts = 1;
+    if (const char* starts_flag = get_flag(argc, argv, "starts")) starts = std::atoi(starts_flag);
+    int refits = BOOTSTRAP_REFITS;
+    if (const char* bootstrap = get_flag(argc, argv, "bootstrap")) refits = std::atoi(bootstrap);
+    if (refits < 0) {
+        std::cerr << "--bootstrap needs 0 or more refits" << std::endl;
+        return 1;
+    }
+    int profile_points = 0;
+    if (const char* profile = get_flag(argc, argv, "profile")) profile_points = std::atoi(profile);
+    if (profile_points < 0) {
+        std::cerr << "--profile needs 0 or more grid points" << std::endl;
+        return 1;
+    }
+    const char* resume_name = get_flag(argc, argv, "resume");
+    const char* checkpoint_name = resume_name ? resume_name : get_flag(argc, argv, "checkpoint");
+    double checkpoint_interval = CHECKPOINT_INTERVAL;
+    if (const char* interval = get_flag(argc, argv, "checkpoint-interval")) checkpoint_interval = std::atof(interval);
+    if (const char* level = get_flag(argc, argv, "log")) {
+        if (std::strcmp(level, "quiet") == 0) log_level = LogLevel::quiet;
+        else if (std::strcmp(level, "info") == 0) log_level = LogLevel::info;
+        else if (std::strcmp(level, "debug") == 0) log_level = LogLevel::debug;
+        else {
+            std::cerr << "Unknown log level " << level << std::endl;
+            return 1;
+        }
+    }
+    double metrics_interval = METRICS_INTERVAL;
+    if (const char* interval = get_flag(argc, argv, "metrics-interval")) metrics_interval = std::atof(interval);
     std::vector<Params> params;
-    std::fstream params_file;
-    params_file.open(argv[2], std::ofstream::in);
-    std::string line;
-    std::stringstream line_stream;
-    while (std::getline(params_file, line)) {
-        line_stream.str(line);
-        params.push_back(Params(line_stream));
-        line_stream.clear();
-    }
-    params_file.close();
     std::vector<Conditions> conditions;
-    std::fstream conditions_file;
-    conditions_file.open(argv[3], std::ofstream::in);
-    while (std::getline(conditions_file, line)) {
-        line_stream.str(line);
-        conditions.push_back(Conditions(line_stream));
-        line_stream.clear();
-    }
-    conditions_file.close();
-    if (std::strcmp(argv[1],"gen") == 0) {
-        for (int i = 0; i < params.size(); i++) {
-            if (std::strcmp(argv[4], "mass") == 0) {
-                Masses masses(conditions[i], params[i], std::atof(argv[7]), std::atof(argv[6]));
-                masses.print(std::to_string(i) + std::string(argv[5]));
-            } else if (std::strcmp(argv[4], "conc") == 0) {
-                Concentrations concentrations(conditions[i], params[i], std::atof(argv[7]), std::atof(argv[6]));
-				std::string output_file_name = std::to_string(i) + std::string(argv[5]);
-                concentrations.print(output_file_name);
-            }
-        }
-    } else if (std::strcmp(argv[1], "fit") == 0) {
+    try {
+        if (const char* metrics_name = get_flag(argc, argv, "metrics")) metrics.start(metrics_name, metrics_interval);
+        if (const char* layout = get_flag(argc, argv, "bins")) {
+            int exact = 0;
+            double ratio = 0, largest = 0;
+            std::sscanf(layout, "%d,%lf,%lf", &exact, &ratio, &largest);
+            bins.layout(exact, ratio, largest);
+        }
+        if (serving) {
+#if KINETICS_MMAP
+            return serve(argv[2], integrator, pool);
+#else
+            throw std::runtime_error("serve needs Unix sockets");
+#endif
+        }
+        params = read_params(argv[2]);
+        conditions = read_conditions(argv[3]);
+        for (int i = 0; bins.active() && i < conditions.size(); i++) bins.lump(conditions[i].agg);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (std::strcmp(argv[1],"gen") == 0 && std::strcmp(argv[4], "ensemble") == 0) {
+        if (bins.active()) {
+            std::cerr << "ensemble runs the exact chain, without --bins" << std::endl;
+            return 1;
+        }
+        if (integrator.method == Method::rk45) {
+            std::cerr << "ensemble runs with euler or ros2" << std::endl;
+            return 1;
+        }
+        try {
+            generate_ensemble(params, conditions, std::atof(argv[7]), integrator, points > 0 ? points : DEFAULT_POINTS, pool, argv[5], binary);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (std::strcmp(argv[1],"gen") == 0) {
+        std::unique_ptr<Checkpoint> checkpoint;
+        try {
+            if (checkpoint_name) checkpoint.reset(new Checkpoint(checkpoint_name, resume_name != nullptr, checkpoint_interval));
+            for (int i = checkpoint ? checkpoint->row : 0; i < params.size(); i++) {
+                if (checkpoint) checkpoint->row = i;
+                if (std::strcmp(argv[4], "mass") == 0) {
+                    Masses masses(conditions[i % conditions.size()], params[i], std::atof(argv[7]), integrator, points > 0 ? points : DEFAULT_POINTS, true, checkpoint.get());
+                    if (std::isfinite(masses.settled) && logging(LogLevel::info)) std::cout << "\nSteady state from time " << masses.settled << std::endl;
+                    if (binary) masses.print_binary(std::to_string(i) + std::string(argv[5]), params[i], conditions[i % conditions.size()], integrator.step_size);
+                    else masses.print(std::to_string(i) + std::string(argv[5]));
+                } else if (std::strcmp(argv[4], "conc") == 0) {
+                    Concentrations concentrations(conditions[i % conditions.size()], params[i], std::atof(argv[7]), integrator, points, checkpoint.get());
+                    std::string output_file_name = std::to_string(i) + std::string(argv[5]);
+                    if (binary) concentrations.print_binary(output_file_name);
+                    else concentrations.print(output_file_name);
+                }
+            }
+            if (checkpoint) {
+                // Nothing is left to redo
+                checkpoint->row = params.size();
+                checkpoint->begin();
+                checkpoint->commit();
+            }
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (std::strcmp(argv[1], "sweep") == 0) {
+        try {
+            if (std::strcmp(argv[4], "mass") != 0 && std::strcmp(argv[4], "conc") != 0) throw std::runtime_error("sweep writes mass or conc curves");
+            sweep(params, conditions, std::strcmp(argv[4], "conc") == 0, std::atof(argv[7]), integrator, points, pool, argv[5]);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (std::strcmp(argv[1], "bench") == 0) {
+        try {
+            std::vector<Masses> real_data = read_data(argv[4]);
+            bench(params, conditions, real_data, std::atof(argv[7]), integrator, pool, argv[5]);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (std::strcmp(argv[1], "uncertainty") == 0) {
+        try {
+            std::vector<Masses> real_data = read_data(argv[4]);
+            std::unique_ptr<EvalCache> cache(new EvalCache(get_flag(argc, argv, "cache")));
+            uncertainty(real_data, params, conditions, integrator, pool, refits, profile_points, speculative, cache.get(), early_abort, argv[5]);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (std::strcmp(argv[1], "fit") == 0 || std::strcmp(argv[1], "lm") == 0) {
         std::vector<Masses> real_data;
-        std::fstream fit_file;
-        fit_file.open(argv[4], std::ofstream::in);
-        std::string fit_string;
-        while (std::getline(fit_file, fit_string, '>')) {
-            real_data.push_back(Masses(fit_string));
+        try {
+            real_data = read_data(argv[4]);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        Params result;
+        if (std::strcmp(argv[1], "lm") == 0) {
+            if (integrator.method != Method::ros2) {
+                std::cerr << "lm runs with ros2" << std::endl;
+                return 1;
+            }
+            result = lmFit(real_data, params, conditions, integrator, pool).first;
+        } else {
+            std::unique_ptr<EvalCache> cache;
+            try {
+                cache.reset(new EvalCache(get_flag(argc, argv, "cache")));
+            } catch (std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            try {
+                result = multiStartFit(real_data, params, conditions, integrator, pool, starts, speculative, cache.get(), early_abort, checkpoint_name, resume_name != nullptr, checkpoint_interval).first;
+            } catch (std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            if (logging(LogLevel::info)) std::cout << "Cached evaluations: " << cache->hits << " hits, " << cache->misses << " misses" << std::endl;
+        }
+        if (integrator.steady > 0 && logging(LogLevel::info)) {
+            for (int i = 0; i < conditions.size(); i++) {
+                Masses model(conditions[i], result, real_data[i].times[real_data[i].times.size() - 1], integrator, DEFAULT_POINTS, false);
+                if (std::isfinite(model.settled)) std::cout << "Dataset " << i << " steady from time " << model.settled << std::endl;
+                else std::cout << "Dataset " << i << " not steady by its last time" << std::endl;
+            }
         }
-        Params result = globalFit(real_data, params, conditions, std::atof(argv[6]));
         std::ofstream output;
         output.open(argv[5], std::ofstream::out | std::ofstream::trunc);
         output << "n:" << result.n << std::endl;
@@ -553,6 +3750,7 @@ int main(int argc, char *argv[]) {
         output << "backward:" << result.backward[0] << ',' << result.backward[1] << ',' << result.backward[2] << std::endl;
         output.close();
     }
+    metrics.stop();
 	std::cout << "Algorithm completed, hit ENTER to end" << std::endl;
 	std::cin.get();
     return 0;
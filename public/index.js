@@ -83,7 +83,7 @@ let app = new Vue({
             .attr("transform", "translate(" + margin.left + "," + margin.top + ")");
             
             let text = await (new Response(blob)).text();
-            let parsedObject = Papa.parse(text);
+            let parsedObject = Papa.parse(text, { skipEmptyLines: true });
             let parsedData = parsedObject.data;
             let d3Data = [];
             let ymax = 0;
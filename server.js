@@ -1,10 +1,13 @@
 // Dependencies
 const express = require('express');
+const net = require('net');
 
 const app = express();
 const port = process.env.PORT || 5000;
 
 const model = require(__dirname + '/server_model.js');
+// Unix socket of a running `model serve`; without it requests run in server_model.js
+const modelSocket = process.env.MODEL_SOCKET;
 
 /* Middleware */
 // Bodyparser
@@ -19,8 +22,45 @@ app.get('/test', (req, res) => {
     res.send('test requested');
 });
 
+// Sends the request body to the native model server and streams its csv back
+const proxyModel = (req, res) => {
+    const socket = net.createConnection(modelSocket, () => socket.write(JSON.stringify(req.body) + '\n'));
+    let status = Buffer.alloc(0);
+    let streaming = false;
+    socket.on('data', (chunk) => {
+        if (!streaming) {
+            // The first line is {"status": "ok"} or {"error": "..."}
+            status = Buffer.concat([status, chunk]);
+            const newline = status.indexOf('\n');
+            if (newline < 0) return;
+            const reply = JSON.parse(status.subarray(0, newline).toString());
+            if (reply.error) {
+                socket.destroy();
+                return res.status(400).send(reply.error);
+            }
+            streaming = true;
+            res.attachment((req.body.metaparameters && req.body.metaparameters.output_file) || 'output.csv');
+            chunk = status.subarray(newline + 1);
+        }
+        if (!res.write(chunk)) {
+            socket.pause();
+            res.once('drain', () => socket.resume());
+        }
+    });
+    socket.on('end', () => {
+        if (streaming) res.end();
+        else if (!res.headersSent) res.status(502).send('Model server closed the connection');
+    });
+    socket.on('error', (err) => {
+        if (!res.headersSent) res.status(502).send('Model server unavailable: ' + err.message);
+        else res.destroy(err);
+    });
+    res.on('close', () => socket.destroy());
+}
+
 app.post('/model', async (req, res) => {
     console.log(JSON.stringify(req.body));
+    if (modelSocket) return proxyModel(req, res);
     await model.print_concentration(req.body.initialConditions, req.body.n, req.body.forwardRates, req.body.backwardRates, req.body.metaparameters, req.body.nm);
     return res.download(__dirname + '/' + req.body.metaparameters.output_file);
     // Test request: